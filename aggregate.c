@@ -0,0 +1,769 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <limits.h>
+#include <stdint.h>
+#include <errno.h>
+
+#include "aggregate.h"
+#include "io.h"
+#include "rng.h"
+
+#define AGGREGATE_INITIAL_HISTOGRAM 64
+#define AGGREGATE_MAX_CENTROIDS (2*AGGREGATE_COMPRESSION + AGGREGATE_PENDING)
+
+void aggregate_init(struct aggregate *a, bool use_threshold, long threshold) {
+    a->count = 0;
+    a->use_threshold = use_threshold;
+    a->threshold = threshold;
+    a->successes = 0;
+    a->lo = 0;
+    a->len = 0;
+    a->counts = NULL;
+    a->digest = false;
+    a->min = LONG_MAX;
+    a->max = LONG_MIN;
+    a->mean = 0;
+    a->m2 = 0;
+    a->centroids = NULL;
+    a->ncentroids = 0;
+    a->npending = 0;
+}
+
+void aggregate_free(struct aggregate *a) {
+    free(a->counts);
+    free(a->centroids);
+    aggregate_init(a, a->use_threshold, a->threshold);
+}
+
+int compare_centroids(const void *a, const void *b) {
+    double x = ((const struct centroid *)a)->mean;
+    double y = ((const struct centroid *)b)->mean;
+    return (x > y) - (x < y);
+}
+
+/*
+   Largest share of the results that may sit at or below the end of a
+   centroid starting at share q, under the k1 scale function
+   k(q) = compression/(2 pi) asin(2q - 1): centroids span at most one unit
+   of k, so they stay small near the tails, where quantiles are most
+   sensitive to them.
+   Ref: Dunning and Ertl, "Computing extremely accurate quantiles using t-digests" (2019).
+*/
+double centroid_limit(double q) {
+    double k = AGGREGATE_COMPRESSION/(2*M_PI)*asin(2*q - 1) + 1;
+    if(k >= AGGREGATE_COMPRESSION/4.0) {
+        return 1;
+    }
+    return (sin(k*2*M_PI/AGGREGATE_COMPRESSION) + 1)/2;
+}
+
+// Sort the centroids together with the pending points and merge neighbours while they fit.
+void digest_compress(struct aggregate *a) {
+    if(a->npending == 0) {
+        return;
+    }
+    struct centroid *c = a->centroids;
+    qsort(c, a->ncentroids, sizeof(struct centroid), compare_centroids);
+    double total = 0;
+    long i;
+    for(i = 0; i < a->ncentroids; ++i) {
+        total += c[i].weight;
+    }
+    long out = 0;
+    double before = 0;
+    double limit = total*centroid_limit(0);
+    struct centroid current = c[0];
+    for(i = 1; i < a->ncentroids; ++i) {
+        if(before + current.weight + c[i].weight <= limit) {
+            current.weight += c[i].weight;
+            current.mean += (c[i].mean - current.mean)*c[i].weight/current.weight;
+        } else {
+            before += current.weight;
+            c[out++] = current;
+            current = c[i];
+            limit = total*centroid_limit(before/total);
+        }
+    }
+    c[out++] = current;
+    a->ncentroids = out;
+    a->npending = 0;
+}
+
+void digest_append(struct aggregate *a, double mean, double weight) {
+    a->centroids[a->ncentroids].mean = mean;
+    a->centroids[a->ncentroids].weight = weight;
+    ++a->ncentroids;
+    if(++a->npending == AGGREGATE_PENDING) {
+        digest_compress(a);
+    }
+}
+
+// Weighted Welford update of the moments with count more results equal to x.
+void digest_add(struct aggregate *a, long x, long count) {
+    if(x < a->min) {
+        a->min = x;
+    }
+    if(x > a->max) {
+        a->max = x;
+    }
+    double delta = x - a->mean;
+    a->mean += delta*count/a->count;
+    a->m2 += delta*(x - a->mean)*count;
+    digest_append(a, x, count);
+}
+
+// Switch over to the t-digest, moving any exact counts into it.
+void start_digest(struct aggregate *a) {
+    a->centroids = malloc(sizeof(struct centroid)*AGGREGATE_MAX_CENTROIDS);
+    if(!a->centroids) {
+        fprintf(stderr, "Error allocating memory.\n");
+        exit(1);
+    }
+    a->digest = true;
+    if(a->counts == NULL) {
+        return;
+    }
+    long total = a->count;
+    a->count = 0;
+    long i;
+    for(i = 0; i < a->len; ++i) {
+        if(a->counts[i] > 0) {
+            a->count += a->counts[i];
+            digest_add(a, a->lo + i, a->counts[i]);
+        }
+    }
+    a->count = total;
+    free(a->counts);
+    a->counts = NULL;
+    a->len = 0;
+}
+
+/*
+   Widen the histogram so that it covers x, doubling it each time so that
+   results trickling outwards cost little. Gives up and switches to the
+   t-digest once the results would need more than AGGREGATE_MAX_HISTOGRAM
+   counts.
+*/
+bool histogram_covers(struct aggregate *a, long x) {
+    if(a->counts != NULL && x >= a->lo && (unsigned long)x - (unsigned long)a->lo < (unsigned long)a->len) {
+        return true;
+    }
+    long lo = x;
+    long hi = x;
+    if(a->counts != NULL) {
+        lo = x < a->lo ? x : a->lo;
+        hi = x < a->lo ? a->lo + (a->len - 1) : x;
+    }
+    if((unsigned long)hi - (unsigned long)lo >= (unsigned long)AGGREGATE_MAX_HISTOGRAM) {
+        start_digest(a);
+        return false;
+    }
+    long len = a->len > 0 ? 2*a->len : AGGREGATE_INITIAL_HISTOGRAM;
+    if(len < hi - lo + 1) {
+        len = hi - lo + 1;
+    }
+    if(len > AGGREGATE_MAX_HISTOGRAM) {
+        len = AGGREGATE_MAX_HISTOGRAM;
+    }
+    // Leave the new room on the side the results are spreading to, without running off the end of long.
+    long new_lo = lo;
+    if(x < a->lo && a->counts != NULL) {
+        new_lo = (unsigned long)hi - (unsigned long)LONG_MIN < (unsigned long)(len - 1) ? LONG_MIN : hi - (len - 1);
+    } else if((unsigned long)LONG_MAX - (unsigned long)lo < (unsigned long)(len - 1)) {
+        new_lo = LONG_MAX - (len - 1);
+    }
+    long *counts = calloc(len, sizeof(long));
+    if(!counts) {
+        fprintf(stderr, "Error allocating memory.\n");
+        exit(1);
+    }
+    if(a->counts != NULL) {
+        memcpy(counts + (a->lo - new_lo), a->counts, sizeof(long)*a->len);
+        free(a->counts);
+    }
+    a->counts = counts;
+    a->lo = new_lo;
+    a->len = len;
+    return true;
+}
+
+void aggregate_insert(struct aggregate *a, long x, long count) {
+    a->count += count;
+    if(!a->digest && histogram_covers(a, x)) {
+        a->counts[x - a->lo] += count;
+    } else {
+        digest_add(a, x, count);
+    }
+}
+
+void aggregate_add_count(struct aggregate *a, long x, long count) {
+    if(count <= 0) {
+        return;
+    }
+    if(a->use_threshold && x >= a->threshold) {
+        a->successes += count;
+    }
+    aggregate_insert(a, x, count);
+}
+
+void aggregate_add(struct aggregate *a, long x) {
+    aggregate_add_count(a, x, 1);
+}
+
+// Fold b into a; b is left empty.
+void aggregate_merge(struct aggregate *a, struct aggregate *b) {
+    a->successes += b->successes;
+    long i;
+    if(!b->digest) {
+        for(i = 0; i < b->len; ++i) {
+            if(b->counts[i] > 0) {
+                aggregate_insert(a, b->lo + i, b->counts[i]);
+            }
+        }
+    } else if(b->count > 0) {
+        if(!a->digest) {
+            start_digest(a);
+        }
+        // Ref: Chan, Golub and LeVeque, "Updating formulae and a pairwise algorithm for computing sample variances" (1979).
+        double n = a->count + b->count;
+        double delta = b->mean - a->mean;
+        a->mean += delta*b->count/n;
+        a->m2 += b->m2 + delta*delta*((double)a->count*b->count/n);
+        a->count += b->count;
+        a->min = b->min < a->min ? b->min : a->min;
+        a->max = b->max > a->max ? b->max : a->max;
+        for(i = 0; i < b->ncentroids; ++i) {
+            digest_append(a, b->centroids[i].mean, b->centroids[i].weight);
+        }
+    }
+    aggregate_free(b);
+}
+
+// Smallest result with at least a share q of the results at or below it.
+long histogram_quantile(const struct aggregate *a, double q) {
+    double target = ceil(q*a->count);
+    if(target < 1) {
+        target = 1;
+    }
+    long seen = 0;
+    long i;
+    for(i = 0; i < a->len; ++i) {
+        seen += a->counts[i];
+        if(seen >= target) {
+            return a->lo + i;
+        }
+    }
+    return a->lo + a->len - 1;
+}
+
+// Interpolates between the centres of the centroids, pinned to the extremes at either end.
+double digest_quantile(const struct aggregate *a, double q) {
+    double target = q*a->count;
+    double prev_position = 0;
+    double prev_value = a->min;
+    double seen = 0;
+    long i;
+    for(i = 0; i < a->ncentroids; ++i) {
+        double position = seen + a->centroids[i].weight/2;
+        if(target < position) {
+            return prev_value + (a->centroids[i].mean - prev_value)*(target - prev_position)/(position - prev_position);
+        }
+        prev_position = position;
+        prev_value = a->centroids[i].mean;
+        seen += a->centroids[i].weight;
+    }
+    if(a->count <= prev_position) {
+        return a->max;
+    }
+    return prev_value + (a->max - prev_value)*(target - prev_position)/(a->count - prev_position);
+}
+
+void print_summary_line(const char *name, const char *format, double value) {
+    char line[64];
+    int len = snprintf(line, sizeof(line), format, value);
+    output_bytes(name, strlen(name));
+    output_char(' ');
+    output_bytes(line, len);
+    output_char('\n');
+}
+
+void print_summary_count(const char *name, long value) {
+    output_bytes(name, strlen(name));
+    output_char(' ');
+    output_long(value);
+    output_char('\n');
+}
+
+/*
+   Prints the count, the number of successes for thresholded statements,
+   the extremes, mean, sample variance and a few quantiles, one per line,
+   then, while results are counted exactly, each result with its count.
+*/
+void print_aggregate(struct aggregate *a) {
+    static const double quantiles[] = { 0.01, 0.05, 0.25, 0.5, 0.75, 0.95, 0.99 };
+    static const char *quantile_names[] = { "p1", "p5", "p25", "p50", "p75", "p95", "p99" };
+    print_summary_count("count", a->count);
+    if(a->use_threshold) {
+        print_summary_count("successes", a->successes);
+    }
+    if(a->count == 0) {
+        return;
+    }
+    long min = a->min;
+    long max = a->max;
+    double mean = a->mean;
+    double m2 = a->m2;
+    long i;
+    if(a->digest) {
+        digest_compress(a);
+    } else {
+        for(min = 0; a->counts[min] == 0; ++min);
+        for(max = a->len - 1; a->counts[max] == 0; --max);
+        long seen = 0;
+        for(i = min; i <= max; ++i) {
+            if(a->counts[i] > 0) {
+                seen += a->counts[i];
+                double delta = (a->lo + i) - mean;
+                mean += delta*a->counts[i]/seen;
+                m2 += delta*((a->lo + i) - mean)*a->counts[i];
+            }
+        }
+        min += a->lo;
+        max += a->lo;
+    }
+    print_summary_count("min", min);
+    print_summary_count("max", max);
+    print_summary_line("mean", "%.10g", mean);
+    print_summary_line("variance", "%.10g", a->count > 1 ? m2/(a->count - 1) : 0);
+    for(i = 0; i < (long)(sizeof(quantiles)/sizeof(quantiles[0])); ++i) {
+        if(a->digest) {
+            print_summary_line(quantile_names[i], "%.10g", digest_quantile(a, quantiles[i]));
+        } else {
+            print_summary_count(quantile_names[i], histogram_quantile(a, quantiles[i]));
+        }
+    }
+    if(!a->digest) {
+        for(i = 0; i < a->len; ++i) {
+            if(a->counts[i] > 0) {
+                output_long(a->lo + i);
+                output_char(' ');
+                output_long(a->counts[i]);
+                output_char('\n');
+            }
+        }
+    }
+}
+
+/*
+   With --shard each process writes the aggregates of its slice of the reps
+   instead of printing them, for `dice merge` to combine. All fields are
+   little-endian:
+
+     file header: "DICEAGGS"  u32 version (2)  u32 reserved (0)  u64 shard index  u64 shard count
+     then one record per statement:
+       u64 statement hash (see statement_hash)
+       u64 count  u32 use_threshold  u32 digest  i64 threshold  u64 successes
+       exact counts: i64 lo  u64 len  then len u64 counts
+       t-digest:     i64 min  i64 max  f64 mean  f64 m2  u64 ncentroids  then ncentroids (f64 mean, f64 weight)
+*/
+#define SHARD_MAGIC "DICEAGGS"
+#define SHARD_VERSION 2
+
+void out_buffer_u32(struct out_buffer *b, uint32_t v) {
+    out_buffer_reserve(b, 4);
+    put_le32(b->data + b->len, v);
+    b->len += 4;
+}
+
+void out_buffer_u64(struct out_buffer *b, uint64_t v) {
+    out_buffer_reserve(b, 8);
+    put_le64(b->data + b->len, v);
+    b->len += 8;
+}
+
+void out_buffer_f64(struct out_buffer *b, double v) {
+    uint64_t bits;
+    memcpy(&bits, &v, sizeof(bits));
+    out_buffer_u64(b, bits);
+}
+
+void write_shard_header(long shard_index, long shard_count) {
+    struct out_buffer b;
+    out_buffer_init(&b);
+    out_buffer_bytes(&b, SHARD_MAGIC, 8);
+    out_buffer_u32(&b, SHARD_VERSION);
+    out_buffer_u32(&b, 0);
+    out_buffer_u64(&b, shard_index);
+    out_buffer_u64(&b, shard_count);
+    output_bytes(b.data, b.len);
+    out_buffer_free(&b);
+}
+
+// Appends a's record to b, in the layout above; read_aggregate reads it back.
+void serialise_aggregate(struct out_buffer *b, struct aggregate *a) {
+    out_buffer_u64(b, a->count);
+    out_buffer_u32(b, a->use_threshold);
+    out_buffer_u32(b, a->digest);
+    out_buffer_u64(b, a->threshold);
+    out_buffer_u64(b, a->successes);
+    long i;
+    if(!a->digest) {
+        // Only the occupied part of the histogram is worth keeping.
+        long first = 0;
+        long last = -1;
+        if(a->count > 0) {
+            for(first = 0; a->counts[first] == 0; ++first);
+            for(last = a->len - 1; a->counts[last] == 0; --last);
+        }
+        out_buffer_u64(b, a->lo + first);
+        out_buffer_u64(b, last - first + 1);
+        for(i = first; i <= last; ++i) {
+            out_buffer_u64(b, a->counts[i]);
+        }
+    } else {
+        digest_compress(a);
+        out_buffer_u64(b, a->min);
+        out_buffer_u64(b, a->max);
+        out_buffer_f64(b, a->mean);
+        out_buffer_f64(b, a->m2);
+        out_buffer_u64(b, a->ncentroids);
+        for(i = 0; i < a->ncentroids; ++i) {
+            out_buffer_f64(b, a->centroids[i].mean);
+            out_buffer_f64(b, a->centroids[i].weight);
+        }
+    }
+}
+
+/*
+   Appends a's whole state to b for a checkpoint: unlike a shard record it
+   keeps the histogram's extent and the t-digest's uncompressed points, and
+   leaves a as it is, so that adding to what read_aggregate_state reads back
+   gives just what adding to a would have. Same fields as a shard record, then
+     exact counts: i64 lo  u64 len  u64 first  u64 n  then n u64 counts from lo + first
+     t-digest:     i64 min  i64 max  f64 mean  f64 m2  u64 ncentroids  u64 npending  then the centroids
+*/
+void serialise_aggregate_state(struct out_buffer *b, const struct aggregate *a) {
+    out_buffer_u64(b, a->count);
+    out_buffer_u32(b, a->use_threshold);
+    out_buffer_u32(b, a->digest);
+    out_buffer_u64(b, a->threshold);
+    out_buffer_u64(b, a->successes);
+    long i;
+    if(!a->digest) {
+        long first = 0;
+        long last = -1;
+        if(a->count > 0) {
+            for(first = 0; a->counts[first] == 0; ++first);
+            for(last = a->len - 1; a->counts[last] == 0; --last);
+        }
+        out_buffer_u64(b, a->lo);
+        out_buffer_u64(b, a->len);
+        out_buffer_u64(b, first);
+        out_buffer_u64(b, last - first + 1);
+        for(i = first; i <= last; ++i) {
+            out_buffer_u64(b, a->counts[i]);
+        }
+    } else {
+        out_buffer_u64(b, a->min);
+        out_buffer_u64(b, a->max);
+        out_buffer_f64(b, a->mean);
+        out_buffer_f64(b, a->m2);
+        out_buffer_u64(b, a->ncentroids);
+        out_buffer_u64(b, a->npending);
+        for(i = 0; i < a->ncentroids; ++i) {
+            out_buffer_f64(b, a->centroids[i].mean);
+            out_buffer_f64(b, a->centroids[i].weight);
+        }
+    }
+}
+
+/*
+   Fingerprint of what a statement rolls, so that merge can tell when
+   shard files come from different scripts. The header is written before
+   the script is read, so each record carries its own.
+*/
+uint64_t statement_hash(const struct parse_tree *t) {
+    uint64_t h = mix64((uint64_t)t->nreps);
+    h = mix64(h ^ (uint64_t)t->use_threshold);
+    h = mix64(h ^ (uint64_t)(t->use_threshold ? t->threshold : 0));
+    const struct roll_encoding *d;
+    for(d = t->dice_specs; d != NULL; d = d->next) {
+        h = mix64(h ^ (uint64_t)d->ndice);
+        h = mix64(h ^ (uint64_t)d->nsides);
+        h = mix64(h ^ (uint64_t)d->dir);
+        h = mix64(h ^ (uint64_t)d->explode);
+        h = mix64(h ^ (uint64_t)(d->keep ? d->discard : -1));
+    }
+    return h;
+}
+
+void write_aggregate(struct aggregate *a, uint64_t hash) {
+    struct out_buffer b;
+    out_buffer_init(&b);
+    out_buffer_u64(&b, hash);
+    serialise_aggregate(&b, a);
+    output_bytes(b.data, b.len);
+    out_buffer_free(&b);
+}
+
+// Returns 0 on success, 1 at a clean end of file and -1 if the file is cut short.
+int read_u32(FILE *ist, uint32_t *v) {
+    unsigned char b[4];
+    size_t got = fread(b, 1, 4, ist);
+    if(got != 4) {
+        return got == 0 ? 1 : -1;
+    }
+    *v = b[0] | (uint32_t)b[1] << 8 | (uint32_t)b[2] << 16 | (uint32_t)b[3] << 24;
+    return 0;
+}
+
+int read_u64(FILE *ist, uint64_t *v) {
+    uint32_t lo, hi;
+    int status = read_u32(ist, &lo);
+    if(status != 0) {
+        return status;
+    }
+    if(read_u32(ist, &hi) != 0) {
+        return -1;
+    }
+    *v = lo | (uint64_t)hi << 32;
+    return 0;
+}
+
+int read_f64(FILE *ist, double *v) {
+    uint64_t bits;
+    int status = read_u64(ist, &bits);
+    if(status == 0) {
+        memcpy(v, &bits, sizeof(bits));
+    }
+    return status;
+}
+
+// Reads the next record into the empty aggregate a, with the same return values as read_u32.
+int read_aggregate(FILE *ist, struct aggregate *a) {
+    uint64_t count, threshold, successes, n;
+    uint32_t use_threshold, digest;
+    aggregate_init(a, false, 0);
+    int status = read_u64(ist, &count);
+    if(status != 0) {
+        return status;
+    }
+    if(read_u32(ist, &use_threshold) || read_u32(ist, &digest)
+        || read_u64(ist, &threshold) || read_u64(ist, &successes)) {
+        return -1;
+    }
+    aggregate_init(a, use_threshold, threshold);
+    a->successes = successes;
+    uint64_t i;
+    if(!digest) {
+        uint64_t lo;
+        if(read_u64(ist, &lo) || read_u64(ist, &n)) {
+            return -1;
+        }
+        for(i = 0; i < n; ++i) {
+            uint64_t c;
+            if(read_u64(ist, &c)) {
+                return -1;
+            }
+            if(c > 0) {
+                aggregate_insert(a, (long)(lo + i), c);
+            }
+        }
+    } else {
+        uint64_t min, max;
+        start_digest(a);
+        if(read_u64(ist, &min) || read_u64(ist, &max) || read_f64(ist, &a->mean)
+            || read_f64(ist, &a->m2) || read_u64(ist, &n)) {
+            return -1;
+        }
+        a->count = count;
+        a->min = min;
+        a->max = max;
+        for(i = 0; i < n; ++i) {
+            double mean, weight;
+            if(read_f64(ist, &mean) || read_f64(ist, &weight)) {
+                return -1;
+            }
+            digest_append(a, mean, weight);
+        }
+    }
+    if((uint64_t)a->count != count) {
+        return -1;
+    }
+    return 0;
+}
+
+// Reads what serialise_aggregate_state wrote into the empty aggregate a; returns 0 on success.
+int read_aggregate_state(FILE *ist, struct aggregate *a) {
+    uint64_t count, threshold, successes, n;
+    uint32_t use_threshold, digest;
+    aggregate_init(a, false, 0);
+    if(read_u64(ist, &count) || read_u32(ist, &use_threshold) || read_u32(ist, &digest)
+        || read_u64(ist, &threshold) || read_u64(ist, &successes)) {
+        return 1;
+    }
+    aggregate_init(a, use_threshold, threshold);
+    a->count = count;
+    a->successes = successes;
+    uint64_t i;
+    if(!digest) {
+        uint64_t lo, len, first;
+        if(read_u64(ist, &lo) || read_u64(ist, &len) || read_u64(ist, &first) || read_u64(ist, &n)
+            || len > AGGREGATE_MAX_HISTOGRAM || first + n > len) {
+            return 1;
+        }
+        if(len > 0) {
+            a->counts = calloc(len, sizeof(long));
+            if(!a->counts) {
+                fprintf(stderr, "Error allocating memory.\n");
+                exit(1);
+            }
+            a->lo = lo;
+            a->len = len;
+        }
+        for(i = 0; i < n; ++i) {
+            uint64_t c;
+            if(read_u64(ist, &c)) {
+                return 1;
+            }
+            a->counts[first + i] = c;
+        }
+    } else {
+        uint64_t min, max, npending;
+        start_digest(a);
+        if(read_u64(ist, &min) || read_u64(ist, &max) || read_f64(ist, &a->mean) || read_f64(ist, &a->m2)
+            || read_u64(ist, &n) || read_u64(ist, &npending) || n > AGGREGATE_MAX_CENTROIDS || npending > n) {
+            return 1;
+        }
+        a->min = min;
+        a->max = max;
+        for(i = 0; i < n; ++i) {
+            if(read_f64(ist, &a->centroids[i].mean) || read_f64(ist, &a->centroids[i].weight)) {
+                return 1;
+            }
+        }
+        a->ncentroids = n;
+        a->npending = npending;
+    }
+    return 0;
+}
+
+struct shard_file {
+    const char *path;
+    FILE *ist;
+    long index;
+    long count;
+};
+
+int compare_shard_files(const void *a, const void *b) {
+    long x = ((const struct shard_file *)a)->index;
+    long y = ((const struct shard_file *)b)->index;
+    return (x > y) - (x < y);
+}
+
+/*
+   `dice merge` entry point: combines the shard files statement by
+   statement, in shard order, and prints the summaries as --aggregate
+   would. Exact counts merge exactly, so a complete set of shards prints
+   just what a single process would have.
+*/
+int merge_shards(int nfiles, char **paths) {
+    if(nfiles < 1) {
+        fprintf(stderr, "Usage: dice merge FILE...\n");
+        return 1;
+    }
+    struct shard_file *shards = malloc(sizeof(struct shard_file)*nfiles);
+    if(!shards) {
+        fprintf(stderr, "Error allocating memory.\n");
+        exit(1);
+    }
+    int status = 0;
+    int i;
+    for(i = 0; i < nfiles; ++i) {
+        shards[i].path = paths[i];
+        errno = 0;
+        shards[i].ist = fopen(paths[i], "rb");
+        if(shards[i].ist == NULL) {
+            fprintf(stderr, "Error %d (%s) opening file %s\n", errno, strerror(errno), paths[i]);
+            exit(1);
+        }
+        char magic[8];
+        uint32_t version, reserved;
+        uint64_t index, count;
+        if(fread(magic, 1, 8, shards[i].ist) != 8 || 0 != memcmp(magic, SHARD_MAGIC, 8)
+            || read_u32(shards[i].ist, &version) || version != SHARD_VERSION || read_u32(shards[i].ist, &reserved)
+            || read_u64(shards[i].ist, &index) || read_u64(shards[i].ist, &count)) {
+            fprintf(stderr, "%s is not a dice shard file.\n", paths[i]);
+            exit(1);
+        }
+        shards[i].index = index;
+        shards[i].count = count;
+    }
+    qsort(shards, nfiles, sizeof(struct shard_file), compare_shard_files);
+    bool complete = nfiles == shards[0].count;
+    for(i = 0; i < nfiles; ++i) {
+        if(shards[i].count != shards[0].count || shards[i].index != i) {
+            complete = false;
+        }
+    }
+    if(!complete) {
+        fprintf(stderr, "Warning: the files given are not shards 0 to %ld of %ld, so the merge is partial.\n", shards[0].count - 1, shards[0].count);
+    }
+    while(status == 0) {
+        struct aggregate merged;
+        int nread = 0;
+        int nended = 0;
+        uint64_t first_hash = 0;
+        for(i = 0; i < nfiles; ++i) {
+            struct aggregate part;
+            uint64_t hash;
+            int read_status = read_u64(shards[i].ist, &hash);
+            if(read_status == 0) {
+                read_status = read_aggregate(shards[i].ist, &part);
+                if(read_status != 0) {
+                    read_status = -1;
+                }
+            } else {
+                aggregate_init(&part, false, 0);
+            }
+            if(read_status > 0) {
+                ++nended;
+                aggregate_free(&part);
+            } else if(read_status < 0) {
+                fprintf(stderr, "%s is cut short.\n", shards[i].path);
+                aggregate_free(&part);
+                status = 1;
+            } else if(nread++ == 0) {
+                merged = part;
+                first_hash = hash;
+            } else if(hash != first_hash || part.use_threshold != merged.use_threshold
+                || (part.use_threshold && part.threshold != merged.threshold)) {
+                fprintf(stderr, "%s holds a different statement from %s; shards can only be merged with shards of the same script.\n", shards[i].path, shards[0].path);
+                aggregate_free(&part);
+                status = 1;
+            } else {
+                aggregate_merge(&merged, &part);
+            }
+        }
+        if(nended == nfiles) {
+            break;
+        }
+        if(status == 0 && nended > 0) {
+            fprintf(stderr, "The shard files hold different numbers of statements.\n");
+            status = 1;
+        }
+        if(status == 0) {
+            print_aggregate(&merged);
+        }
+        if(nread > 0) {
+            aggregate_free(&merged);
+        }
+    }
+    for(i = 0; i < nfiles; ++i) {
+        fclose(shards[i].ist);
+    }
+    free(shards);
+    return status;
+}
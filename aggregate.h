@@ -0,0 +1,59 @@
+#ifndef __AGGREGATE_H__
+#define __AGGREGATE_H__
+#include <stdbool.h>
+#include <stdio.h>
+#include "io.h"
+#include "parse.h"
+
+#define AGGREGATE_MAX_HISTOGRAM (1L << 20) // Widest run of results that is still counted exactly
+#define AGGREGATE_COMPRESSION 200 // t-digest compression, roughly the number of centroids kept
+#define AGGREGATE_PENDING (8*AGGREGATE_COMPRESSION) // Points buffered before the t-digest is compressed
+
+struct centroid {
+    double mean;
+    double weight;
+};
+
+/*
+   Running summary of a statement's results. While they fit in
+   AGGREGATE_MAX_HISTOGRAM consecutive values every result is counted, so
+   the histogram and quantiles are exact; after that the counts are folded
+   into a t-digest and the mean and variance are kept with Welford updates.
+*/
+struct aggregate {
+    long count;
+    bool use_threshold;
+    long threshold;
+    long successes;
+    // Exact counts: counts[i] is the number of results equal to lo + i.
+    long lo;
+    long len;
+    long *counts;
+    // t-digest, once counts is NULL.
+    bool digest;
+    long min;
+    long max;
+    double mean;
+    double m2; // Sum of squared deviations from the mean
+    struct centroid *centroids;
+    long ncentroids;
+    long npending; // Points appended to centroids since the last compression
+};
+
+void aggregate_init(struct aggregate *a, bool use_threshold, long threshold);
+void aggregate_free(struct aggregate *a);
+void aggregate_add(struct aggregate *a, long x);
+void aggregate_add_count(struct aggregate *a, long x, long count);
+void aggregate_merge(struct aggregate *a, struct aggregate *b);
+void print_aggregate(struct aggregate *a);
+void write_shard_header(long shard_index, long shard_count);
+void serialise_aggregate(struct out_buffer *b, struct aggregate *a);
+void serialise_aggregate_state(struct out_buffer *b, const struct aggregate *a);
+uint64_t statement_hash(const struct parse_tree *t);
+void write_aggregate(struct aggregate *a, uint64_t hash);
+int read_u32(FILE *ist, uint32_t *v);
+int read_u64(FILE *ist, uint64_t *v);
+int read_aggregate(FILE *ist, struct aggregate *a);
+int read_aggregate_state(FILE *ist, struct aggregate *a);
+int merge_shards(int nfiles, char **paths);
+#endif // __AGGREGATE_H__
@@ -0,0 +1,83 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "alias.h"
+#include "dist.h"
+#include "rng.h"
+
+void alias_table_init(struct alias_table *a) {
+    a->min = 0;
+    a->len = 0;
+    a->prob = NULL;
+    a->alias = NULL;
+}
+
+void alias_table_free(struct alias_table *a) {
+    free(a->prob);
+    free(a->alias);
+    alias_table_init(a);
+}
+
+// Ref: Vose, "A linear algorithm for generating random numbers with a given distribution", IEEE TSE 17 (1991).
+void alias_table_build(struct alias_table *a, const struct distribution *x) {
+    long n = x->len;
+    a->min = x->min;
+    a->len = n;
+    a->prob = malloc(sizeof(double)*n);
+    a->alias = malloc(sizeof(long)*n);
+    long *small = malloc(sizeof(long)*n);
+    long *large = malloc(sizeof(long)*n);
+    if(!a->prob || !a->alias || !small || !large) {
+        fprintf(stderr, "Error allocating memory.\n");
+        exit(1);
+    }
+    double total = 0;
+    long i;
+    for(i = 0; i < n; ++i) {
+        total += x->p[i];
+    }
+    long nsmall = 0;
+    long nlarge = 0;
+    for(i = 0; i < n; ++i) {
+        a->prob[i] = x->p[i]*n/total;
+        a->alias[i] = i;
+        if(a->prob[i] < 1) {
+            small[nsmall++] = i;
+        } else {
+            large[nlarge++] = i;
+        }
+    }
+    while(nsmall > 0 && nlarge > 0) {
+        long s = small[--nsmall];
+        long l = large[--nlarge];
+        a->alias[s] = l;
+        a->prob[l] -= 1 - a->prob[s];
+        if(a->prob[l] < 1) {
+            small[nsmall++] = l;
+        } else {
+            large[nlarge++] = l;
+        }
+    }
+    // Whatever is left over is only off 1 by rounding error.
+    while(nlarge > 0) {
+        a->prob[large[--nlarge]] = 1;
+    }
+    while(nsmall > 0) {
+        a->prob[small[--nsmall]] = 1;
+    }
+    free(small);
+    free(large);
+}
+
+// The integer part of u*len picks the column and the fractional part tosses its coin.
+long alias_sample(const struct alias_table *a, struct rng_stream *r) {
+    double scaled = rng_unif(r)*a->len;
+    long column = (long)scaled;
+    if(column >= a->len) {
+        column = a->len - 1;
+    }
+    if(scaled - column < a->prob[column]) {
+        return a->min + column;
+    }
+    return a->min + a->alias[column];
+}
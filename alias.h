@@ -0,0 +1,21 @@
+#ifndef __ALIAS_H__
+#define __ALIAS_H__
+#include "dist.h"
+#include "rng.h"
+
+/*
+   Walker/Vose alias table: after O(len) setup, draws from a distribution
+   with one uniform and one table lookup.
+*/
+struct alias_table {
+    long min;
+    long len;
+    double *prob; // Chance of keeping column i rather than taking its alias
+    long *alias;
+};
+
+void alias_table_init(struct alias_table *a);
+void alias_table_free(struct alias_table *a);
+void alias_table_build(struct alias_table *a, const struct distribution *x);
+long alias_sample(const struct alias_table *a, struct rng_stream *r);
+#endif // __ALIAS_H__
@@ -0,0 +1,61 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "arena.h"
+
+struct arena_block *arena_block_create(size_t size) {
+    struct arena_block *b = malloc(sizeof(struct arena_block) + size);
+    if(!b) {
+        fprintf(stderr, "Error allocating memory.\n");
+        exit(1);
+    }
+    b->next = NULL;
+    b->size = size;
+    b->used = 0;
+    return b;
+}
+
+struct arena *arena_create() {
+    struct arena *a = malloc(sizeof(struct arena));
+    if(!a) {
+        fprintf(stderr, "Error allocating memory.\n");
+        exit(1);
+    }
+    a->first = arena_block_create(ARENA_BLOCK_SIZE);
+    a->current = a->first;
+    return a;
+}
+
+void *arena_alloc(struct arena *a, size_t size) {
+    size = (size + sizeof(max_align_t) - 1)/sizeof(max_align_t)*sizeof(max_align_t);
+    struct arena_block *b = a->current;
+    while(b->size - b->used < size) {
+        if(b->next == NULL) {
+            b->next = arena_block_create(size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE);
+        }
+        b = b->next;
+        b->used = 0; // Blocks after the current one hold nothing since the last reset.
+    }
+    a->current = b;
+    void *p = (char *)b->data + b->used;
+    b->used += size;
+    return p;
+}
+
+void arena_reset(struct arena *a) {
+    a->current = a->first;
+    a->first->used = 0;
+}
+
+void arena_destroy(struct arena *a) {
+    if(a == NULL) {
+        return;
+    }
+    struct arena_block *b = a->first;
+    while(b != NULL) {
+        struct arena_block *next = b->next;
+        free(b);
+        b = next;
+    }
+    free(a);
+}
@@ -0,0 +1,30 @@
+#ifndef __ARENA_H__
+#define __ARENA_H__
+#include <stddef.h>
+
+#define ARENA_BLOCK_SIZE 4096 // Bytes per block, enough for a typical line and its compiled statements
+
+struct arena_block {
+    struct arena_block *next;
+    size_t size;
+    size_t used;
+    max_align_t data[];
+};
+
+/*
+   Bump allocator for everything that lives exactly as long as one line of
+   input: its statements, their dice and what they compile to. Nothing is
+   freed on its own; arena_reset rewinds to the first block in O(1) and
+   keeps the blocks for the next line, so parsing stops touching the heap
+   once the arena has grown to fit the longest line.
+*/
+struct arena {
+    struct arena_block *first;
+    struct arena_block *current;
+};
+
+struct arena *arena_create();
+void *arena_alloc(struct arena *a, size_t size);
+void arena_reset(struct arena *a);
+void arena_destroy(struct arena *a);
+#endif // __ARENA_H__
@@ -5,10 +5,27 @@
 #include <unistd.h>
 #include <string.h>
 #include "io.h"
+#include "threads.h"
 
 const char *argp_program_version = "Dice 0.9";
 const char *argp_program_bug_address = "https://notabug.org/cryptarch/dice/issues";
 
+// Keys for options that have no short form.
+enum long_only_option {
+    EXACT_BUDGET_KEY = 0x100,
+    OUTPUT_FORMAT_KEY,
+    OUTPUT_FILE_KEY,
+    SHARD_KEY,
+    CHECKPOINT_KEY,
+    CHECKPOINT_INTERVAL_KEY,
+    RESUME_KEY,
+    CACHE_SIZE_KEY,
+    CACHE_STATS_KEY,
+    CALIBRATE_KEY,
+    THREADS_KEY,
+    AFFINITY_KEY
+};
+
 /*
    OPTIONS.  Field 1 in ARGP.
    Order of fields: {NAME, KEY, ARG, FLAGS, DOC}.
@@ -16,6 +33,20 @@ const char *argp_program_bug_address = "https://notabug.org/cryptarch/dice/issue
 static struct argp_option options[] = {
     {"prompt",  'p', "STRING", 0, "Set the dice interactive prompt to STRING.\n(Default: 'dice> ')"},
     {"seed", 's', "NUMBER", 0, "Set the seed to NUMBER. (Default is obtained from /dev/urandom.)"},
+    {"exact", 'e', NULL, 0, "Print the exact probability of every outcome instead of rolling."},
+    {"aggregate", 'a', NULL, 0, "Print a summary of each statement's reps (count, extremes, mean, variance, quantiles and, when there are not too many distinct results, a histogram) instead of every rep."},
+    {"exact-budget", EXACT_BUDGET_KEY, "NUMBER", 0, "Count the successes of thresholded rolls in one step when working out the odds of success takes at most NUMBER outcomes, otherwise roll every rep. 0 always rolls every rep. (Default: 4194304)"},
+    {"output-format", OUTPUT_FORMAT_KEY, "FORMAT", 0, "Write results as FORMAT: text, int64 or int32 (raw little-endian integers, one per rep), or columnar (int64 with a header for the file and for each statement). (Default: text)"},
+    {"output-file", OUTPUT_FILE_KEY, "FILE", 0, "Write results to FILE, through a memory mapping, instead of standard output."},
+    {"shard", SHARD_KEY, "I/N", 0, "Roll only shard I (counting from 0) of N equal slices of every statement's reps, and write their summaries in binary for `dice merge FILE...` to combine. Shards of the same script and seed add up to a single run's counts; quantiles from a t-digest are approximate."},
+    {"checkpoint", CHECKPOINT_KEY, "FILE", 0, "Every so often save how far the run has got to FILE, and on Ctrl-C or SIGTERM save it and stop instead of abandoning the statement. FILE is removed once the run completes."},
+    {"checkpoint-interval", CHECKPOINT_INTERVAL_KEY, "SECONDS", 0, "Save a checkpoint every SECONDS seconds. (Default: 60)"},
+    {"resume", RESUME_KEY, NULL, 0, "Carry on from the checkpoint given with --checkpoint, taking its seed. Run the same script with the same options; with --output-file the file is continued from where the checkpoint left it."},
+    {"cache-size", CACHE_SIZE_KEY, "NUMBER", 0, "Remember the statements of the last NUMBER distinct lines, so repeated lines are not parsed again. 0 parses every line. (Default: 256)"},
+    {"cache-stats", CACHE_STATS_KEY, NULL, 0, "On exit, print how often lines were found in the statement cache."},
+    {"calibrate", CALIBRATE_KEY, NULL, 0, "Time rolling, printing and starting threads on this machine before reading any input, and save the figures in ~/.dice_calibration for choosing how to roll. Otherwise this happens on first use."},
+    {"threads", THREADS_KEY, "NUMBER", 0, "Use at most NUMBER threads. (Default: one per CPU, or OMP_NUM_THREADS)"},
+    {"affinity", AFFINITY_KEY, "POLICY", 0, "Pin the threads to CPUs: compact (neighbouring CPUs), spread (evenly over the CPUs this process may use) or a list such as 0-3,8. (Default: not pinned)"},
     {"help", 'h', NULL, 0, "Print this help message."},
     {"version", 'v', NULL, 0, "Print version information."},
     {0}
@@ -47,15 +78,14 @@ static error_t parse_opt (int key, char *arg, struct argp_state *state) {
                 char *arg_iter;
                 for(arg_iter = arg; *arg_iter != '\0'; ++arg_iter) {
                     if(!isdigit(*arg_iter)) {
-                        fprintf(stderr, "The random seed must be a number between 0 and %u.\n", UINT_MAX);
+                        fprintf(stderr, "The random seed must be a number between 0 and %llu.\n", (unsigned long long)UINT64_MAX);
                         exit(1);
                     }
                 }
                 char *s_endptr;
                 errno = 0;
-                arguments->seed = strtol(arg, &s_endptr, 10);
-                if((errno == ERANGE && (arguments->seed == LONG_MAX || arguments->seed == LONG_MIN))
-                    || (errno != 0 && arguments->seed == 0)) {
+                arguments->seed = strtoull(arg, &s_endptr, 10);
+                if(errno != 0) {
                     fprintf(stderr, "Error %d (%s) setting seed to %s.\n", errno, strerror(errno), arg);
                     arguments->seed_set = false;
                     return 1;
@@ -64,6 +94,126 @@ static error_t parse_opt (int key, char *arg, struct argp_state *state) {
                 }
             }
             break;
+        case 'e':
+            {
+                arguments->exact = true;
+            }
+            break;
+        case 'a':
+            {
+                arguments->aggregate = true;
+            }
+            break;
+        case EXACT_BUDGET_KEY:
+            {
+                char *b_endptr;
+                errno = 0;
+                arguments->exact_budget = strtol(arg, &b_endptr, 10);
+                if(errno != 0 || *b_endptr != '\0' || arguments->exact_budget < 0) {
+                    fprintf(stderr, "The exact budget must be a number between 0 and %ld.\n", LONG_MAX);
+                    exit(1);
+                }
+            }
+            break;
+        case OUTPUT_FORMAT_KEY:
+            {
+                if(0 == strcmp(arg, "text")) {
+                    arguments->output_format = OUTPUT_TEXT;
+                } else if(0 == strcmp(arg, "int64")) {
+                    arguments->output_format = OUTPUT_INT64;
+                } else if(0 == strcmp(arg, "int32")) {
+                    arguments->output_format = OUTPUT_INT32;
+                } else if(0 == strcmp(arg, "columnar")) {
+                    arguments->output_format = OUTPUT_COLUMNAR;
+                } else {
+                    fprintf(stderr, "Unknown output format %s (expected text, int64, int32 or columnar).\n", arg);
+                    exit(1);
+                }
+            }
+            break;
+        case OUTPUT_FILE_KEY:
+            {
+                arguments->output_file = arg;
+            }
+            break;
+        case SHARD_KEY:
+            {
+                char *i_endptr;
+                char *n_endptr = NULL;
+                errno = 0;
+                arguments->shard_index = strtol(arg, &i_endptr, 10);
+                if(*i_endptr == '/') {
+                    arguments->shard_count = strtol(i_endptr + 1, &n_endptr, 10);
+                }
+                if(errno != 0 || i_endptr == arg || n_endptr == NULL || n_endptr == i_endptr + 1 || *n_endptr != '\0'
+                    || arguments->shard_count < 1 || arguments->shard_index < 0 || arguments->shard_index >= arguments->shard_count) {
+                    fprintf(stderr, "The shard must be given as I/N with 0 <= I < N.\n");
+                    exit(1);
+                }
+            }
+            break;
+        case CHECKPOINT_KEY:
+            {
+                arguments->checkpoint_file = arg;
+            }
+            break;
+        case CHECKPOINT_INTERVAL_KEY:
+            {
+                char *c_endptr;
+                errno = 0;
+                arguments->checkpoint_interval = strtol(arg, &c_endptr, 10);
+                if(errno != 0 || *c_endptr != '\0' || arguments->checkpoint_interval < 0) {
+                    fprintf(stderr, "The checkpoint interval must be a number of seconds between 0 and %ld.\n", LONG_MAX);
+                    exit(1);
+                }
+            }
+            break;
+        case RESUME_KEY:
+            {
+                arguments->resume = true;
+            }
+            break;
+        case CACHE_SIZE_KEY:
+            {
+                char *z_endptr;
+                errno = 0;
+                arguments->cache_size = strtol(arg, &z_endptr, 10);
+                if(errno != 0 || *z_endptr != '\0' || arguments->cache_size < 0) {
+                    fprintf(stderr, "The cache size must be a number between 0 and %ld.\n", LONG_MAX);
+                    exit(1);
+                }
+            }
+            break;
+        case CACHE_STATS_KEY:
+            {
+                arguments->cache_stats = true;
+            }
+            break;
+        case CALIBRATE_KEY:
+            {
+                arguments->calibrate = true;
+            }
+            break;
+        case THREADS_KEY:
+            {
+                char *t_endptr;
+                errno = 0;
+                long threads = strtol(arg, &t_endptr, 10);
+                if(errno != 0 || *t_endptr != '\0' || threads < 1 || threads > INT_MAX) {
+                    fprintf(stderr, "The number of threads must be between 1 and %d.\n", INT_MAX);
+                    exit(1);
+                }
+                arguments->threads = threads;
+            }
+            break;
+        case AFFINITY_KEY:
+            {
+                if(0 != affinity_parse(arg, &arguments->affinity)) {
+                    fprintf(stderr, "Unknown affinity %s (expected compact, spread or a list of CPUs such as 0-3,8).\n", arg);
+                    exit(1);
+                }
+            }
+            break;
         case 'v':
             {
                 printf("%s\n", argp_program_version);
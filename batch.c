@@ -0,0 +1,153 @@
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "batch.h"
+#include "rng.h"
+#include "roll-engine.h"
+
+/*
+   Non-exploding dice drawn many at a time. Die roll_num of a term is the
+   first word of its own stream, rng_stream_id(term_id, roll_num), so the
+   streams of a run of dice are computed side by side, one die per vector
+   lane, into a buffer of words, and the words are then turned into faces
+   and summed in a second vectorised loop. The faces are exactly those
+   die_face would give: the few words that multiply-shift would reject are
+   marked with a face of 0 and those dice are rolled again one at a time.
+
+   The loops are compiled for AVX-512, AVX2, SSE4.2 and plain x86-64, and
+   the best one the CPU supports is picked when the program is loaded.
+   Elsewhere there is only the portable version.
+*/
+
+#if defined(__GNUC__) && defined(__x86_64__) && defined(__linux__) && defined(__has_attribute)
+#if __has_attribute(target_clones)
+#define SIMD_CLONES __attribute__((target_clones("avx512f", "avx2", "sse4.2", "default")))
+#define SIMD_CLONES_X86 1
+#endif
+#endif
+#ifndef SIMD_CLONES
+#define SIMD_CLONES
+#endif
+
+// Whether die_faces can roll dice with nsides sides: one 32-bit word must be enough for a face.
+bool die_batch_applies(long nsides) {
+    return nsides >= 2 && (uint64_t)nsides <= ((uint64_t)1 << 32);
+}
+
+// First word of the stream of each die first, ..., first + n - 1 of term_id.
+SIMD_CLONES
+static void die_words(uint64_t term_id, long first, long n, uint32_t *words) {
+    uint32_t key0 = rng_key[0];
+    uint32_t key1 = rng_key[1];
+    long i;
+    #pragma omp simd
+    for(i = 0; i < n; ++i) {
+        uint64_t id = mix64(term_id ^ mix64((uint64_t)(first + i) + RNG_INDEX_OFFSET));
+        uint32_t c0 = 0;
+        uint32_t c1 = 0;
+        uint32_t c2 = (uint32_t)id;
+        uint32_t c3 = (uint32_t)(id >> 32);
+        uint32_t k0 = key0;
+        uint32_t k1 = key1;
+        // Written out, as the rounds of the lanes run side by side.
+        PHILOX_ROUND(c0, c1, c2, c3, k0, k1);
+        PHILOX_ROUND(c0, c1, c2, c3, k0, k1);
+        PHILOX_ROUND(c0, c1, c2, c3, k0, k1);
+        PHILOX_ROUND(c0, c1, c2, c3, k0, k1);
+        PHILOX_ROUND(c0, c1, c2, c3, k0, k1);
+        PHILOX_ROUND(c0, c1, c2, c3, k0, k1);
+        PHILOX_ROUND(c0, c1, c2, c3, k0, k1);
+        PHILOX_ROUND(c0, c1, c2, c3, k0, k1);
+        PHILOX_ROUND(c0, c1, c2, c3, k0, k1);
+        PHILOX_ROUND(c0, c1, c2, c3, k0, k1);
+        words[i] = c3; // rng_next32 hands out the block from the top down
+    }
+}
+
+/*
+   Faces for the words, as uniform_below maps them, or 0 where it would
+   reject the word and draw again. Returns the total of the faces.
+*/
+SIMD_CLONES
+static long words_to_faces(const uint32_t *words, long n, uint64_t range, long *faces) {
+    long sum = 0;
+    long i;
+    if((range & (range - 1)) == 0) {
+        uint32_t mask = (uint32_t)(range - 1);
+        #pragma omp simd reduction(+:sum)
+        for(i = 0; i < n; ++i) {
+            faces[i] = 1 + (long)(words[i] & mask);
+            sum += faces[i];
+        }
+    } else {
+        uint32_t range32 = (uint32_t)range;
+        #pragma omp simd reduction(+:sum)
+        for(i = 0; i < n; ++i) {
+            uint64_t m = (uint64_t)words[i] * range32;
+            faces[i] = (uint32_t)m < range32 ? 0 : 1 + (long)(m >> 32);
+            sum += faces[i];
+        }
+    }
+    return sum;
+}
+
+// Rolls the dice words_to_faces left at 0 one at a time, and returns what they add to the total.
+static long reroll_rejected(uint64_t term_id, long first, long n, long nsides, long *faces) {
+    long sum = 0;
+    long i;
+    for(i = 0; i < n; ++i) {
+        if(faces[i] == 0) {
+            struct rng_stream r;
+            rng_stream_init(&r, rng_stream_id(term_id, first + i));
+            faces[i] = die_face(&r, nsides);
+            sum += faces[i];
+        }
+    }
+    return sum;
+}
+
+/*
+   Faces of dice first, ..., first + n - 1 of term_id, each with nsides
+   sides (see die_batch_applies), into faces. Returns their total.
+*/
+long die_faces(uint64_t term_id, long first, long n, long nsides, long *faces) {
+    uint32_t words[DIE_BATCH];
+    long sum = 0;
+    long done;
+    for(done = 0; done < n; done += DIE_BATCH) {
+        long count = n - done < DIE_BATCH ? n - done : DIE_BATCH;
+        die_words(term_id, first + done, count, words);
+        sum += words_to_faces(words, count, (uint64_t)nsides, faces + done);
+        sum += reroll_rejected(term_id, first + done, count, nsides, faces + done);
+    }
+    return sum;
+}
+
+// Total of dice first, ..., first + n - 1 of term_id, without keeping the faces.
+long die_faces_total(uint64_t term_id, long first, long n, long nsides) {
+    long faces[DIE_BATCH];
+    long sum = 0;
+    long done;
+    for(done = 0; done < n; done += DIE_BATCH) {
+        long count = n - done < DIE_BATCH ? n - done : DIE_BATCH;
+        sum += die_faces(term_id, first + done, count, nsides, faces);
+    }
+    return sum;
+}
+
+// Instruction set the kernels run with on this CPU, for dice-bench.
+const char *die_batch_isa() {
+#ifdef SIMD_CLONES_X86
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx512f")) {
+        return "avx512f";
+    }
+    if(__builtin_cpu_supports("avx2")) {
+        return "avx2";
+    }
+    if(__builtin_cpu_supports("sse4.2")) {
+        return "sse4.2";
+    }
+#endif
+    return "scalar";
+}
@@ -0,0 +1,12 @@
+#ifndef __BATCH_H__
+#define __BATCH_H__
+#include <stdbool.h>
+#include <stdint.h>
+
+#define DIE_BATCH 256 // Dice drawn at a time, one random word per die in a buffer on the stack
+
+bool die_batch_applies(long nsides);
+long die_faces(uint64_t term_id, long first, long n, long nsides, long *faces);
+long die_faces_total(uint64_t term_id, long first, long n, long nsides);
+const char *die_batch_isa();
+#endif // __BATCH_H__
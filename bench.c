@@ -0,0 +1,274 @@
+#define _GNU_SOURCE 1 // Needed for fmemopen and getline.
+#include <argp.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef _OPENMP
+#include <omp.h>
+#else
+#define omp_get_max_threads() 1
+#endif
+
+#include "batch.h"
+#include "cache.h"
+#include "io.h"
+#include "parse.h"
+#include "plan.h"
+#include "rng.h"
+#include "roll-engine.h"
+#include "threads.h"
+
+/*
+   dice-bench times dice on whole lines from inside the process, so the
+   figures are not swamped by starting a process per roll. Each statement is
+   run as a line of a pipe (getline_wrapper) and as a line typed at the
+   prompt (interactive_line, which flushes the results every line), and the
+   median and 99th percentile nanoseconds per line are printed. With
+   --scaling, big statements are instead run through the pipe path with 1,
+   2, ... up to the maximum number of threads, and the median seconds per
+   line, the speedup over one thread and the efficiency (speedup per
+   thread) are printed. The results of the rolls themselves go to /dev/null.
+*/
+
+const char *argp_program_version = "dice-bench 0.9";
+const char *argp_program_bug_address = "https://notabug.org/cryptarch/dice/issues";
+
+#define BENCH_DEFAULT_LINES 100000
+#define SCALING_DEFAULT_LINES 5
+
+enum bench_option {
+    SCALING_KEY = 0x100,
+    THREADS_KEY,
+    AFFINITY_KEY
+};
+
+struct bench_arguments {
+    long lines; // 0 until given
+    bool scaling;
+    int threads;
+    struct affinity affinity;
+    char **statements;
+    int nstatements;
+};
+
+static char *latency_statements[] = { "d20+5", "4d6k3", "d6; d6; d6", "10x 3d6" };
+// Exploding reps of uneven length, reps of one big pool each, keeping from exploding pools, and big and small statements on one line.
+static char *scaling_statements[] = { "200000x 20d6!", "100x 100000d1000000", "1000x 1000d100!k10", "d100; 100000x 4d6k3; 10000000d1000000" };
+
+static struct argp_option options[] = {
+    {"lines", 'n', "NUMBER", 0, "Time NUMBER lines of each statement in each mode. (Default: 100000, or 5 with --scaling)"},
+    {"scaling", SCALING_KEY, NULL, 0, "Time big statements with 1, 2, ... up to the maximum number of threads instead."},
+    {"threads", THREADS_KEY, "NUMBER", 0, "Use at most NUMBER threads. (Default: one per CPU, or OMP_NUM_THREADS)"},
+    {"affinity", AFFINITY_KEY, "POLICY", 0, "Pin the threads to CPUs: compact, spread or a list such as 0-3,8, as for dice."},
+    {0}
+};
+
+static error_t parse_opt(int key, char *arg, struct argp_state *state) {
+    struct bench_arguments *arguments = state->input;
+    switch(key) {
+        case 'n':
+            {
+                char *endptr;
+                errno = 0;
+                arguments->lines = strtol(arg, &endptr, 10);
+                if(errno != 0 || *endptr != '\0' || arguments->lines < 1) {
+                    fprintf(stderr, "The number of lines must be a number between 1 and %ld.\n", LONG_MAX);
+                    exit(1);
+                }
+            }
+            break;
+        case SCALING_KEY:
+            {
+                arguments->scaling = true;
+            }
+            break;
+        case THREADS_KEY:
+            {
+                char *endptr;
+                errno = 0;
+                long threads = strtol(arg, &endptr, 10);
+                if(errno != 0 || *endptr != '\0' || threads < 1 || threads > INT_MAX) {
+                    fprintf(stderr, "The number of threads must be between 1 and %d.\n", INT_MAX);
+                    exit(1);
+                }
+                arguments->threads = threads;
+            }
+            break;
+        case AFFINITY_KEY:
+            {
+                if(0 != affinity_parse(arg, &arguments->affinity)) {
+                    fprintf(stderr, "Unknown affinity %s (expected compact, spread or a list of CPUs such as 0-3,8).\n", arg);
+                    exit(1);
+                }
+            }
+            break;
+        case ARGP_KEY_ARGS:
+            {
+                arguments->statements = state->argv + state->next;
+                arguments->nstatements = state->argc - state->next;
+            }
+            break;
+        default:
+            return ARGP_ERR_UNKNOWN;
+    }
+    return 0;
+}
+
+static struct argp argp = { options, parse_opt, "[STATEMENT...]", "Time dice over lines of each STATEMENT (by default a few typical ones) read from a pipe and typed at the prompt." };
+
+long nanoseconds_between(const struct timespec *start, const struct timespec *end) {
+    return 1000000000L*(end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec);
+}
+
+int compare_longs(const void *a, const void *b) {
+    long x = *(const long *)a;
+    long y = *(const long *)b;
+    return (x > y) - (x < y);
+}
+
+// Nanoseconds for each of n lines of line, read as dice reads a pipe.
+void time_pipe(struct parse_tree *t, struct arguments *args, const char *line, long n, long *ns) {
+    FILE *ist = fmemopen((void *)line, strlen(line), "r");
+    if(!ist) {
+        fprintf(stderr, "Error %d (%s) opening a line to read.\n", errno, strerror(errno));
+        exit(1);
+    }
+    args->ist = ist;
+    long i;
+    for(i = 0; i < n; ++i) {
+        struct timespec start, end;
+        rewind(ist);
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        getline_wrapper(t, args);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        ns[i] = nanoseconds_between(&start, &end);
+    }
+    output_flush();
+    fclose(ist);
+    args->ist = stdin;
+}
+
+// Nanoseconds for each of n lines of line, typed at the prompt.
+void time_prompt(struct parse_tree *t, struct arguments *args, const char *line, long n, long *ns) {
+    size_t len = strlen(line);
+    long i;
+    for(i = 0; i < n; ++i) {
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        interactive_line(t, line, len, args);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        ns[i] = nanoseconds_between(&start, &end);
+    }
+}
+
+void report(FILE *ost, const char *mode, const char *statement, long *ns, long n) {
+    qsort(ns, n, sizeof(long), compare_longs);
+    fprintf(ost, "%-6s %10ld %10ld  %s\n", mode, ns[n/2], ns[(n - 1)*99/100], statement);
+}
+
+void latency(FILE *ost, struct parse_tree *t, struct arguments *args, const struct bench_arguments *bench, const char *statement, const char *line, long *ns) {
+    long warm_up = bench->lines/10 + 1;
+    time_pipe(t, args, line, warm_up < bench->lines ? warm_up : bench->lines, ns);
+    time_pipe(t, args, line, bench->lines, ns);
+    report(ost, "pipe", statement, ns, bench->lines);
+    time_prompt(t, args, statement, bench->lines, ns);
+    report(ost, "prompt", statement, ns, bench->lines);
+}
+
+// Each team size in turn, pinned afresh so that eg spread spreads each team over all the CPUs.
+void scaling(FILE *ost, struct parse_tree *t, struct arguments *args, const struct bench_arguments *bench, const char *statement, const char *line, long *ns, int max_threads) {
+    double one_thread = 0;
+    int threads;
+    for(threads = 1; threads <= max_threads; ++threads) {
+        threads_configure(threads, &bench->affinity);
+        time_pipe(t, args, line, 1, ns);
+        time_pipe(t, args, line, bench->lines, ns);
+        qsort(ns, bench->lines, sizeof(long), compare_longs);
+        double seconds = 1e-9*ns[bench->lines/2];
+        if(threads == 1) {
+            one_thread = seconds;
+        }
+        double speedup = seconds > 0 ? one_thread/seconds : 0;
+        fprintf(ost, "%7d %10.4f %8.2f %10.2f  %s\n", threads, seconds, speedup, speedup/threads, statement);
+        fflush(ost);
+    }
+}
+
+int main(int argc, char **argv) {
+    struct bench_arguments bench = { 0 };
+    bench.affinity.policy = AFFINITY_NONE;
+    argp_parse(&argp, argc, argv, 0, 0, &bench);
+    if(bench.lines == 0) {
+        bench.lines = bench.scaling ? SCALING_DEFAULT_LINES : BENCH_DEFAULT_LINES;
+    }
+    if(bench.nstatements == 0) {
+        bench.statements = bench.scaling ? scaling_statements : latency_statements;
+        bench.nstatements = bench.scaling ? sizeof(scaling_statements)/sizeof(scaling_statements[0]) : sizeof(latency_statements)/sizeof(latency_statements[0]);
+    }
+
+    // Keep standard output for the report and send the rolls to /dev/null.
+    int report_fd = dup(STDOUT_FILENO);
+    int null_fd = open("/dev/null", O_WRONLY);
+    if(report_fd < 0 || null_fd < 0 || dup2(null_fd, STDOUT_FILENO) < 0) {
+        fprintf(stderr, "Error %d (%s) redirecting the results to /dev/null.\n", errno, strerror(errno));
+        exit(1);
+    }
+    close(null_fd);
+    FILE *ost = fdopen(report_fd, "w");
+
+    struct arguments args;
+    arguments_init(&args);
+    args.mode = PIPE;
+    rng_seed(1);
+    threads_configure(bench.threads, &bench.affinity);
+    calibration_get(false);
+    if(0 != output_open(OUTPUT_TEXT, NULL, 0)) {
+        exit(1);
+    }
+    statement_cache_init(args.cache_size);
+    struct parse_tree *t = malloc(sizeof(struct parse_tree));
+    long *ns = malloc(sizeof(long)*bench.lines);
+    if(!t || !ns) {
+        fprintf(stderr, "Error allocating memory.\n");
+        exit(1);
+    }
+    parse_tree_initialise(t);
+
+    int max_threads = omp_get_max_threads();
+    fprintf(ost, "# die kernels: %s\n", die_batch_isa());
+    if(bench.scaling) {
+        fprintf(ost, "%7s %10s %8s %10s  %s\n", "threads", "seconds", "speedup", "efficiency", "statement");
+    } else {
+        fprintf(ost, "%-6s %10s %10s  %s\n", "mode", "median_ns", "p99_ns", "statement");
+    }
+    int i;
+    for(i = 0; i < bench.nstatements; ++i) {
+        char *line = malloc(strlen(bench.statements[i]) + 2);
+        if(!line) {
+            fprintf(stderr, "Error allocating memory.\n");
+            exit(1);
+        }
+        sprintf(line, "%s\n", bench.statements[i]);
+        if(bench.scaling) {
+            scaling(ost, t, &args, &bench, bench.statements[i], line, ns, max_threads);
+        } else {
+            latency(ost, t, &args, &bench, bench.statements[i], line, ns);
+        }
+        free(line);
+    }
+
+    output_close();
+    statement_cache_free();
+    piece_pool_free();
+    parse_tree_free(t);
+    free(t);
+    free(ns);
+    fclose(ost);
+    return 0;
+}
@@ -0,0 +1,224 @@
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+#include "cache.h"
+
+struct statement_cache statement_cache = { 0, 0, NULL, 0, NULL, -1, -1, NULL, 0, 0, 0 };
+
+void statement_cache_init(long capacity) {
+    statement_cache.capacity = capacity > 0 ? capacity : 0;
+    statement_cache.size = 0;
+    statement_cache.head = -1;
+    statement_cache.tail = -1;
+    statement_cache.hits = 0;
+    statement_cache.misses = 0;
+    statement_cache.entries = NULL;
+    statement_cache.buckets = NULL;
+    statement_cache.nbuckets = 0;
+    statement_cache.line = NULL;
+    statement_cache.line_size = 0;
+    if(statement_cache.capacity == 0) {
+        return;
+    }
+    long nbuckets = 1;
+    while(nbuckets < 2*statement_cache.capacity) {
+        nbuckets *= 2;
+    }
+    statement_cache.entries = malloc(sizeof(struct cache_entry)*statement_cache.capacity);
+    statement_cache.buckets = malloc(sizeof(long)*nbuckets);
+    if(!statement_cache.entries || !statement_cache.buckets) {
+        fprintf(stderr, "Error allocating memory.\n");
+        exit(1);
+    }
+    statement_cache.nbuckets = nbuckets;
+    long i;
+    for(i = 0; i < nbuckets; ++i) {
+        statement_cache.buckets[i] = -1;
+    }
+}
+
+// The key and the tree live in the tree's arena.
+void free_entry(struct cache_entry *e) {
+    arena_destroy(e->tree->arena);
+    e->key = NULL;
+    e->tree = NULL;
+}
+
+void statement_cache_free() {
+    long i;
+    for(i = 0; i < statement_cache.size; ++i) {
+        free_entry(&statement_cache.entries[i]);
+    }
+    free(statement_cache.entries);
+    free(statement_cache.buckets);
+    free(statement_cache.line);
+    statement_cache_init(0);
+}
+
+/*
+   The line as the lexer sees it: no comment, and no whitespace except a
+   single space where it separates two numbers or words, since "1 0" is not
+   "10". Lines that only differ in spacing then share an entry. The result
+   is only good until the next call.
+*/
+const char *normalise_line(const char *buf, size_t len) {
+    if(statement_cache.line_size < len + 1) {
+        free(statement_cache.line);
+        statement_cache.line = malloc(len + 1);
+        if(!statement_cache.line) {
+            fprintf(stderr, "Error allocating memory.\n");
+            exit(1);
+        }
+        statement_cache.line_size = len + 1;
+    }
+    char *key = statement_cache.line;
+    size_t n = 0;
+    bool space = false;
+    size_t i;
+    for(i = 0; i < len && buf[i] != '\0' && buf[i] != '#'; ++i) {
+        char c = buf[i];
+        if(isspace(c)) {
+            space = n > 0;
+            continue;
+        }
+        if(space && isalnum(key[n - 1]) && isalnum(c)) {
+            key[n++] = ' ';
+        }
+        space = false;
+        key[n++] = c;
+    }
+    key[n] = '\0';
+    return key;
+}
+
+// FNV-1a.
+uint64_t hash_key(const char *key) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for(; *key != '\0'; ++key) {
+        h ^= (unsigned char)*key;
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+void unlink_recency(long i) {
+    struct cache_entry *e = &statement_cache.entries[i];
+    if(e->prev >= 0) {
+        statement_cache.entries[e->prev].next = e->next;
+    } else {
+        statement_cache.head = e->next;
+    }
+    if(e->next >= 0) {
+        statement_cache.entries[e->next].prev = e->prev;
+    } else {
+        statement_cache.tail = e->prev;
+    }
+}
+
+void link_most_recent(long i) {
+    struct cache_entry *e = &statement_cache.entries[i];
+    e->prev = -1;
+    e->next = statement_cache.head;
+    if(statement_cache.head >= 0) {
+        statement_cache.entries[statement_cache.head].prev = i;
+    }
+    statement_cache.head = i;
+    if(statement_cache.tail < 0) {
+        statement_cache.tail = i;
+    }
+}
+
+void unlink_bucket(long i) {
+    struct cache_entry *e = &statement_cache.entries[i];
+    long *link = &statement_cache.buckets[e->hash & (statement_cache.nbuckets - 1)];
+    while(*link != i) {
+        link = &statement_cache.entries[*link].chain;
+    }
+    *link = e->chain;
+}
+
+// The statements key parsed to last time, or NULL if they are not cached.
+struct parse_tree *statement_cache_lookup(const char *key) {
+    if(statement_cache.capacity == 0) {
+        return NULL;
+    }
+    uint64_t h = hash_key(key);
+    long i;
+    for(i = statement_cache.buckets[h & (statement_cache.nbuckets - 1)]; i >= 0; i = statement_cache.entries[i].chain) {
+        struct cache_entry *e = &statement_cache.entries[i];
+        if(e->hash == h && 0 == strcmp(e->key, key)) {
+            ++statement_cache.hits;
+            unlink_recency(i);
+            link_most_recent(i);
+            return e->tree;
+        }
+    }
+    ++statement_cache.misses;
+    return NULL;
+}
+
+// Cache t, which must live in its own arena, under a copy of key, and hand back t.
+struct parse_tree *statement_cache_insert(const char *key, struct parse_tree *t) {
+    long i;
+    if(statement_cache.size < statement_cache.capacity) {
+        i = statement_cache.size++;
+    } else {
+        i = statement_cache.tail;
+        unlink_recency(i);
+        unlink_bucket(i);
+        free_entry(&statement_cache.entries[i]);
+    }
+    struct cache_entry *e = &statement_cache.entries[i];
+    size_t key_len = strlen(key);
+    e->key = arena_alloc(t->arena, key_len + 1);
+    memcpy(e->key, key, key_len + 1);
+    e->hash = hash_key(key);
+    e->tree = t;
+    long *bucket = &statement_cache.buckets[e->hash & (statement_cache.nbuckets - 1)];
+    e->chain = *bucket;
+    *bucket = i;
+    link_most_recent(i);
+    return t;
+}
+
+// Lines that do something as they are parsed, like clear or quit, have to be parsed every time.
+bool cacheable(const struct parse_tree *t) {
+    const struct parse_tree *s;
+    for(s = t; s != NULL; s = s->next) {
+        if(s->suppress || s->quit) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+   The statements on a line: from the cache if the line has been seen
+   recently, otherwise parsed into t and, if they parsed cleanly, moved
+   into the cache. Either way the result is what should be rolled.
+*/
+struct parse_tree *parse_cached(struct parse_tree *t, const char *buf, size_t len, int *parse_status) {
+    if(statement_cache.capacity == 0) {
+        *parse_status = parse(t, buf, len);
+        return t;
+    }
+    const char *key = normalise_line(buf, len);
+    struct parse_tree *cached = statement_cache_lookup(key);
+    if(cached != NULL) {
+        *parse_status = 0;
+        return cached;
+    }
+    *parse_status = parse(t, buf, len);
+    if(*parse_status != 0 || !cacheable(t)) {
+        return t;
+    }
+    return statement_cache_insert(key, parse_tree_detach(t));
+}
+
+void print_cache_stats() {
+    fprintf(stderr, "Statement cache: %ld hits, %ld misses, %ld of %ld entries used.\n",
+        statement_cache.hits, statement_cache.misses, statement_cache.size, statement_cache.capacity);
+}
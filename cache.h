@@ -0,0 +1,46 @@
+#ifndef __CACHE_H__
+#define __CACHE_H__
+#include <stdbool.h>
+#include <stdint.h>
+#include "parse.h"
+
+#define STATEMENT_CACHE_DEFAULT_SIZE 256
+
+struct cache_entry {
+    char *key; // Normalised line
+    uint64_t hash;
+    struct parse_tree *tree;
+    long prev; // Neighbours in recency order, -1 at either end
+    long next;
+    long chain; // Next entry in the same bucket, -1 at the end
+};
+
+/*
+   Recently seen lines and the statements they parsed to, so a line that
+   comes round again is rolled without being lexed, parsed, checked or
+   compiled. Entries live in a fixed array, found through a hash table of
+   chains and kept in recency order by a doubly linked list, and the least
+   recently used one is replaced once the array is full.
+*/
+struct statement_cache {
+    long capacity;
+    long size;
+    struct cache_entry *entries;
+    long nbuckets;
+    long *buckets;
+    long head; // Most recently used
+    long tail; // Least recently used
+    char *line; // Normalised form of the line being looked up
+    size_t line_size;
+    long hits;
+    long misses;
+};
+
+void statement_cache_init(long capacity);
+void statement_cache_free();
+const char *normalise_line(const char *buf, size_t len);
+struct parse_tree *statement_cache_lookup(const char *key);
+struct parse_tree *statement_cache_insert(const char *key, struct parse_tree *t);
+struct parse_tree *parse_cached(struct parse_tree *t, const char *buf, size_t len, int *parse_status);
+void print_cache_stats();
+#endif // __CACHE_H__
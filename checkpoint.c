@@ -0,0 +1,262 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include "checkpoint.h"
+#include "io.h"
+
+/*
+   A checkpoint file holds, little-endian:
+
+     "DICECKPT"  u32 version (2)  u32 naggregates
+     u64 seed  u64 statement  u64 rep  u64 nsuccess  u64 nreps  u64 output offset
+     then, for aggregated statements, the aggregate and after it any
+     per-thread parts not yet merged into it, each as serialise_aggregate_state
+     writes it, so that the parts are merged in the same order as they
+     would have been without stopping.
+
+   It is written to a temporary file which then replaces the old one, so a
+   run killed halfway through a checkpoint still has the previous one.
+*/
+#define CHECKPOINT_MAGIC "DICECKPT"
+#define CHECKPOINT_VERSION 2
+
+const char *checkpoint_path = NULL;
+long checkpoint_interval = CHECKPOINT_DEFAULT_INTERVAL;
+uint64_t checkpoint_seed = 0;
+struct timespec checkpoint_last;
+volatile sig_atomic_t checkpoint_stop = 0; // The signal asking us to stop, if any
+
+// Where --resume is to pick up.
+bool resume_pending = false;
+long resume_statement = 0;
+long resume_rep = 0;
+long resume_nsuccess = 0;
+long resume_nreps = 0;
+long resume_naggregates = 0;
+struct aggregate *resume_aggregates = NULL; // The aggregate, then its parts
+bool resume_parts_pending = false;
+
+void checkpoint_signal_handler(int sig) {
+    checkpoint_stop = sig;
+}
+
+// What SIGINT and SIGTERM did before checkpoint_catch_signals, for checkpoint_statement_done to put back.
+bool signals_caught = false;
+void (*saved_sigint_handler)(int) = SIG_DFL;
+void (*saved_sigterm_handler)(int) = SIG_DFL;
+
+void checkpoint_catch_signals() {
+    if(signals_caught) {
+        return;
+    }
+    saved_sigint_handler = signal(SIGINT, checkpoint_signal_handler);
+    saved_sigterm_handler = signal(SIGTERM, checkpoint_signal_handler);
+    signals_caught = true;
+}
+
+bool checkpoint_enabled() {
+    return checkpoint_path != NULL;
+}
+
+void checkpoint_init(const char *path, long interval, uint64_t seed) {
+    checkpoint_path = path;
+    checkpoint_interval = interval;
+    checkpoint_seed = seed;
+    clock_gettime(CLOCK_MONOTONIC, &checkpoint_last);
+    if(!resume_pending) {
+        // A checkpoint left over from some other run must not be resumed by mistake.
+        unlink(path);
+    }
+}
+
+int checkpoint_load(const char *path, uint64_t *seed, uint64_t *output_offset) {
+    errno = 0;
+    FILE *ist = fopen(path, "rb");
+    if(ist == NULL) {
+        fprintf(stderr, "Error %d (%s) opening checkpoint %s\n", errno, strerror(errno), path);
+        return 1;
+    }
+    char magic[8];
+    uint32_t version, naggregates;
+    uint64_t statement, rep, nsuccess, nreps;
+    bool valid = fread(magic, 1, 8, ist) == 8 && 0 == memcmp(magic, CHECKPOINT_MAGIC, 8)
+        && !read_u32(ist, &version) && version == CHECKPOINT_VERSION && !read_u32(ist, &naggregates)
+        && !read_u64(ist, seed) && !read_u64(ist, &statement) && !read_u64(ist, &rep)
+        && !read_u64(ist, &nsuccess) && !read_u64(ist, &nreps) && !read_u64(ist, output_offset);
+    if(valid && naggregates > 0) {
+        resume_aggregates = malloc(sizeof(struct aggregate)*naggregates);
+        if(!resume_aggregates) {
+            fprintf(stderr, "Error allocating memory.\n");
+            exit(1);
+        }
+        for(resume_naggregates = 0; valid && resume_naggregates < naggregates; ++resume_naggregates) {
+            valid = 0 == read_aggregate_state(ist, &resume_aggregates[resume_naggregates]);
+        }
+    }
+    fclose(ist);
+    if(!valid) {
+        fprintf(stderr, "%s is not a dice checkpoint.\n", path);
+        return 1;
+    }
+    resume_pending = true;
+    resume_statement = statement;
+    resume_rep = rep;
+    resume_nsuccess = nsuccess;
+    resume_nreps = nreps;
+    return 0;
+}
+
+// Whether the statement was finished before the checkpoint being resumed.
+bool checkpoint_skip(long statement) {
+    return resume_pending && statement < resume_statement;
+}
+
+// Fill in p from the checkpoint being resumed, if it was taken during this statement.
+void checkpoint_restore(struct progress *p, long nreps) {
+    if(!resume_pending || p->statement != resume_statement) {
+        return;
+    }
+    resume_pending = false;
+    if(resume_rep == 0 && resume_naggregates == 0) {
+        return;
+    }
+    if(nreps != resume_nreps || (resume_naggregates > 0) != (p->agg != NULL)) {
+        fprintf(stderr, "The checkpoint was taken from a different run.\n");
+        exit(1);
+    }
+    p->rep = resume_rep;
+    p->nsuccess = resume_nsuccess;
+    if(p->agg != NULL) {
+        aggregate_free(p->agg);
+        *p->agg = resume_aggregates[0];
+        resume_parts_pending = true;
+        if(resume_naggregates == 1) {
+            checkpoint_restore_parts(p); // Nothing more to hand on
+        }
+    }
+}
+
+/*
+   Fill in the p->nparts parts set up since checkpoint_restore with those
+   the checkpoint kept. Taken with a different number of threads, they are
+   shared out among them instead, which only changes how the t-digest's
+   approximate quantiles come out.
+*/
+void checkpoint_restore_parts(struct progress *p) {
+    if(!resume_parts_pending) {
+        return;
+    }
+    resume_parts_pending = false;
+    long i;
+    for(i = 1; i < resume_naggregates; ++i) {
+        if(resume_naggregates - 1 == p->nparts) {
+            aggregate_free(&p->parts[i - 1]);
+            p->parts[i - 1] = resume_aggregates[i];
+        } else {
+            aggregate_merge(&p->parts[(i - 1)%p->nparts], &resume_aggregates[i]);
+        }
+    }
+    free(resume_aggregates);
+    resume_aggregates = NULL;
+    resume_naggregates = 0;
+}
+
+bool checkpoint_due() {
+    if(checkpoint_path == NULL) {
+        return false;
+    }
+    if(checkpoint_stop) {
+        return true;
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec - checkpoint_last.tv_sec >= checkpoint_interval;
+}
+
+/*
+   Records p, which the caller has brought up to a point where every rep
+   before p->rep is in the output or the aggregate. If we were asked to
+   stop, this is where we do.
+*/
+void checkpoint_save(const struct progress *p, long nreps) {
+    output_checkpoint();
+    struct out_buffer b;
+    out_buffer_init(&b);
+    out_buffer_bytes(&b, CHECKPOINT_MAGIC, 8);
+    out_buffer_reserve(&b, 2*4 + 6*8);
+    put_le32(b.data + b.len, CHECKPOINT_VERSION);
+    put_le32(b.data + b.len + 4, p->agg != NULL ? 1 + p->nparts : 0);
+    put_le64(b.data + b.len + 8, checkpoint_seed);
+    put_le64(b.data + b.len + 16, p->statement);
+    put_le64(b.data + b.len + 24, p->rep);
+    put_le64(b.data + b.len + 32, p->nsuccess);
+    put_le64(b.data + b.len + 40, nreps);
+    put_le64(b.data + b.len + 48, output_position());
+    b.len += 2*4 + 6*8;
+    if(p->agg != NULL) {
+        serialise_aggregate_state(&b, p->agg);
+        int i;
+        for(i = 0; i < p->nparts; ++i) {
+            serialise_aggregate_state(&b, &p->parts[i]);
+        }
+    }
+    size_t tmp_len = strlen(checkpoint_path) + 5;
+    char *tmp_path = malloc(tmp_len);
+    if(!tmp_path) {
+        fprintf(stderr, "Error allocating memory.\n");
+        exit(1);
+    }
+    snprintf(tmp_path, tmp_len, "%s.tmp", checkpoint_path);
+    errno = 0;
+    FILE *ost = fopen(tmp_path, "wb");
+    if(ost == NULL || fwrite(b.data, 1, b.len, ost) != b.len || fflush(ost) != 0
+        || fsync(fileno(ost)) != 0 || fclose(ost) != 0 || rename(tmp_path, checkpoint_path) != 0) {
+        fprintf(stderr, "Error %d (%s) writing checkpoint %s\n", errno, strerror(errno), checkpoint_path);
+    }
+    free(tmp_path);
+    out_buffer_free(&b);
+    clock_gettime(CLOCK_MONOTONIC, &checkpoint_last);
+    if(checkpoint_stop) {
+        output_close();
+        fprintf(stderr, "Stopped; checkpoint saved to %s, carry on with --resume.\n", checkpoint_path);
+        exit(128 + checkpoint_stop);
+    }
+}
+
+/*
+   Between statements there is nothing to save, so signals go back to
+   the handlers they had before the statement; one that came in as the
+   statement finished stops the run here, with a checkpoint at the start
+   of the next statement.
+*/
+void checkpoint_statement_done(long statement) {
+    if(checkpoint_path == NULL) {
+        return;
+    }
+    if(checkpoint_stop) {
+        struct progress next = { statement + 1, 0, 0, NULL, NULL, 0 };
+        checkpoint_save(&next, 0);
+    }
+    if(signals_caught) {
+        signal(SIGINT, saved_sigint_handler);
+        signal(SIGTERM, saved_sigterm_handler);
+        signals_caught = false;
+    }
+}
+
+// The run is complete, so its checkpoint has served its purpose.
+void checkpoint_finish() {
+    if(checkpoint_path == NULL) {
+        return;
+    }
+    if(resume_pending) {
+        fprintf(stderr, "Warning: the run ended before reaching its checkpoint.\n");
+        return;
+    }
+    unlink(checkpoint_path);
+}
@@ -0,0 +1,35 @@
+#ifndef __CHECKPOINT_H__
+#define __CHECKPOINT_H__
+#include <stdbool.h>
+#include <stdint.h>
+#include "aggregate.h"
+
+#define CHECKPOINT_DEFAULT_INTERVAL 60 // Seconds between checkpoints
+
+/*
+   How far a statement has got. Every rep draws from its own stream derived
+   from the seed, the statement and the rep, so this (with the output so far)
+   is all it takes to carry on exactly where a run stopped.
+*/
+struct progress {
+    long statement; // Counts every statement rolled so far in the run
+    long rep; // Next rep to roll, or next block for aggregated_multinomial
+    long nsuccess;
+    struct aggregate *agg; // Summary so far, when the statement is aggregated
+    struct aggregate *parts; // Per-thread summaries not yet merged into agg
+    int nparts;
+};
+
+bool checkpoint_enabled();
+void checkpoint_init(const char *path, long interval, uint64_t seed);
+int checkpoint_load(const char *path, uint64_t *seed, uint64_t *output_offset);
+bool checkpoint_skip(long statement);
+void checkpoint_restore(struct progress *p, long nreps);
+void checkpoint_restore_parts(struct progress *p);
+bool checkpoint_due();
+void checkpoint_save(const struct progress *p, long nreps);
+void checkpoint_statement_done(long statement);
+void checkpoint_finish();
+void checkpoint_signal_handler(int sig);
+void checkpoint_catch_signals();
+#endif // __CHECKPOINT_H__
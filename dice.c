@@ -5,19 +5,27 @@
 
 #include <readline/readline.h>
 
+#include "aggregate.h"
 #include "args.h"
+#include "cache.h"
+#include "checkpoint.h"
+#include "dist.h"
 #include "parse.h"
+#include "plan.h"
 #include "io.h"
+#include "rng.h"
+#include "roll-engine.h"
+#include "threads.h"
 
 int main(int argc, char** argv) {
-    struct arguments args;
-    args.prompt = "\001\e[0;32m\002dice> \001\e[0m\002";
-    if(isatty(fileno(stdin))) {
-        args.mode = INTERACTIVE;
-    } else {
-        args.mode = PIPE;
+    if(argc > 1 && 0 == strcmp(argv[1], "merge")) {
+        int status = merge_shards(argc - 2, argv + 2);
+        output_close();
+        return status;
     }
-    args.ist = stdin;
+
+    struct arguments args;
+    arguments_init(&args);
 
     FILE *rnd_src;
     char rnd_src_path[] = "/dev/urandom";
@@ -40,7 +48,49 @@ int main(int argc, char** argv) {
         args.seed = t.tv_nsec * t.tv_sec;
     }
 
-    srandom(args.seed);
+    uint64_t resume_offset = 0;
+    if(args.resume) {
+        uint64_t seed;
+        if(args.checkpoint_file == NULL) {
+            fprintf(stderr, "--resume needs the --checkpoint file to resume from.\n");
+            exit(1);
+        }
+        if(0 != checkpoint_load(args.checkpoint_file, &seed, &resume_offset)) {
+            exit(1);
+        }
+        args.seed = seed;
+    }
+    if(args.checkpoint_file != NULL) {
+        checkpoint_init(args.checkpoint_file, args.checkpoint_interval, args.seed);
+    }
+    rng_seed(args.seed);
+    threads_configure(args.threads, &args.affinity);
+    if(args.calibrate) {
+        calibration_get(true);
+    }
+
+    if(args.exact && args.aggregate) {
+        fprintf(stderr, "Only one of --exact and --aggregate may be given.\n");
+        exit(1);
+    }
+    if(args.exact && args.output_format != OUTPUT_TEXT) {
+        fprintf(stderr, "Exact odds can only be printed as text.\n");
+        exit(1);
+    }
+    if(args.shard_count > 0 && (args.exact || args.output_format != OUTPUT_TEXT)) {
+        fprintf(stderr, "Shards are written in their own format, so --shard cannot be combined with --exact or --output-format.\n");
+        exit(1);
+    }
+    if(args.aggregate && args.output_format != OUTPUT_TEXT) {
+        fprintf(stderr, "Summaries can only be printed as text.\n");
+        exit(1);
+    }
+    if(0 != output_open(args.output_format, args.output_file, resume_offset)) {
+        exit(1);
+    }
+    if(args.shard_count > 0 && output_position() == 0) {
+        write_shard_header(args.shard_index, args.shard_count);
+    }
 
     struct parse_tree *t = malloc(sizeof(struct parse_tree));
     if(!t) {
@@ -48,6 +98,7 @@ int main(int argc, char** argv) {
         exit(1);
     }
     parse_tree_initialise(t);
+    statement_cache_init(args.cache_size);
 
     char *histfile="~/.dice_history";
     void (*process_next_line)(struct parse_tree*, struct arguments*);
@@ -71,11 +122,19 @@ int main(int argc, char** argv) {
     do {
         process_next_line(t, &args);
     } while(!(t->quit || feof(args.ist)));
+    output_sync();
+    output_close();
+    checkpoint_finish();
+    if(args.cache_stats) {
+        print_cache_stats();
+    }
+    statement_cache_free();
+    piece_pool_free();
     if(args.mode == INTERACTIVE) {
         write_history_wrapper(histfile);
     }
     if(t) {
-        parse_tree_reset(t);
+        parse_tree_free(t);
         free(t);
         t = NULL;
     }
@@ -0,0 +1,527 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <math.h>
+#include <complex.h>
+
+#include "parse.h"
+#include "dist.h"
+#include "io.h"
+
+// Below this many multiply-adds, direct convolution beats the FFT.
+#define DIST_DIRECT_CONVOLUTION_MAX_WORK (1L << 16)
+// FFT results below this fraction of the largest are taken to be rounding error.
+#define DIST_FFT_NOISE 1e-13
+
+void distribution_init(struct distribution *x) {
+    x->min = 0;
+    x->len = 0;
+    x->p = NULL;
+    x->truncated = 0;
+}
+
+void distribution_free(struct distribution *x) {
+    free(x->p);
+    distribution_init(x);
+}
+
+int distribution_alloc(struct distribution *x, long min, long len) {
+    if(len > DIST_MAX_SUPPORT || len < 1) {
+        fprintf(stderr, "Too many possible outcomes to compute exactly; the limit is %ld.\n", DIST_MAX_SUPPORT);
+        return 1;
+    }
+    x->p = calloc(len, sizeof(double));
+    if(!x->p) {
+        fprintf(stderr, "Error allocating memory.\n");
+        exit(1);
+    }
+    x->min = min;
+    x->len = len;
+    x->truncated = 0;
+    return 0;
+}
+
+// Replace *x with *replacement, taking ownership of its storage.
+void distribution_replace(struct distribution *x, struct distribution *replacement) {
+    free(x->p);
+    *x = *replacement;
+    distribution_init(replacement);
+}
+
+int distribution_point(struct distribution *x, long value) {
+    distribution_free(x);
+    if(0 != distribution_alloc(x, value, 1)) {
+        return 1;
+    }
+    x->p[0] = 1;
+    return 0;
+}
+
+// Drop zero-probability outcomes from either end.
+void distribution_trim(struct distribution *x) {
+    long first = 0;
+    long last = x->len - 1;
+    while(first < last && x->p[first] <= 0) {
+        ++first;
+    }
+    while(last > first && x->p[last] <= 0) {
+        --last;
+    }
+    if(first > 0) {
+        memmove(x->p, x->p + first, (last - first + 1)*sizeof(double));
+    }
+    x->min += first;
+    x->len = last - first + 1;
+}
+
+void distribution_negate(struct distribution *x) {
+    long i;
+    for(i = 0; i < x->len/2; ++i) {
+        double tmp = x->p[i];
+        x->p[i] = x->p[x->len - 1 - i];
+        x->p[x->len - 1 - i] = tmp;
+    }
+    x->min = -(x->min + x->len - 1);
+}
+
+// In-place iterative radix-2 FFT; n must be a power of two.
+void fft(double complex *a, long n, bool inverse) {
+    long i, j;
+    for(i = 1, j = 0; i < n; ++i) {
+        long bit = n >> 1;
+        for(; j & bit; bit >>= 1) {
+            j ^= bit;
+        }
+        j ^= bit;
+        if(i < j) {
+            double complex tmp = a[i];
+            a[i] = a[j];
+            a[j] = tmp;
+        }
+    }
+    double complex *roots = malloc(sizeof(double complex)*(n/2 + 1));
+    if(!roots) {
+        fprintf(stderr, "Error allocating memory.\n");
+        exit(1);
+    }
+    for(i = 0; i < n/2; ++i) {
+        roots[i] = cexp((inverse ? 2 : -2)*M_PI*I*i/n);
+    }
+    long len;
+    for(len = 2; len <= n; len <<= 1) {
+        long step = n/len;
+        for(i = 0; i < n; i += len) {
+            for(j = 0; j < len/2; ++j) {
+                double complex u = a[i + j];
+                double complex v = a[i + j + len/2]*roots[j*step];
+                a[i + j] = u + v;
+                a[i + j + len/2] = u - v;
+            }
+        }
+    }
+    free(roots);
+    if(inverse) {
+        for(i = 0; i < n; ++i) {
+            a[i] /= n;
+        }
+    }
+}
+
+/*
+   Both inputs go through one complex FFT, a in the real part and b in the
+   imaginary part, and are separated again using the conjugate symmetry of
+   the transform of a real sequence.
+*/
+void fft_convolve(const struct distribution *a, const struct distribution *b, struct distribution *out) {
+    long n = 1;
+    while(n < out->len) {
+        n <<= 1;
+    }
+    double complex *c = calloc(n, sizeof(double complex));
+    if(!c) {
+        fprintf(stderr, "Error allocating memory.\n");
+        exit(1);
+    }
+    long i;
+    for(i = 0; i < a->len; ++i) {
+        c[i] = a->p[i];
+    }
+    for(i = 0; i < b->len; ++i) {
+        c[i] += I*b->p[i];
+    }
+    fft(c, n, false);
+    for(i = 0; i <= n/2; ++i) {
+        long k = (n - i) & (n - 1);
+        double complex ci = c[i];
+        double complex ck = c[k];
+        double complex ai = (ci + conj(ck))/2;
+        double complex bi = (ci - conj(ck))/(2*I);
+        double complex ak = (ck + conj(ci))/2;
+        double complex bk = (ck - conj(ci))/(2*I);
+        c[i] = ai*bi;
+        c[k] = ak*bk;
+    }
+    fft(c, n, true);
+    double peak = 0;
+    for(i = 0; i < out->len; ++i) {
+        double p = creal(c[i]);
+        if(p > peak) {
+            peak = p;
+        }
+    }
+    // Rounding error leaves tiny values, positive or negative, on outcomes that cannot happen.
+    for(i = 0; i < out->len; ++i) {
+        double p = creal(c[i]);
+        out->p[i] = p > DIST_FFT_NOISE*peak ? p : 0;
+    }
+    free(c);
+}
+
+// Distribution of the sum of independent draws from a and b. out may alias a or b.
+int distribution_convolve(const struct distribution *a, const struct distribution *b, struct distribution *out) {
+    struct distribution sum;
+    distribution_init(&sum);
+    if(0 != distribution_alloc(&sum, a->min + b->min, a->len + b->len - 1)) {
+        return 1;
+    }
+    if(a->len < DIST_DIRECT_CONVOLUTION_MAX_WORK/b->len) {
+        long i, j;
+        for(i = 0; i < a->len; ++i) {
+            if(a->p[i] <= 0) {
+                continue;
+            }
+            for(j = 0; j < b->len; ++j) {
+                sum.p[i + j] += a->p[i]*b->p[j];
+            }
+        }
+    } else {
+        fft_convolve(a, b, &sum);
+    }
+    sum.truncated = 1 - (1 - a->truncated)*(1 - b->truncated);
+    distribution_trim(&sum);
+    distribution_replace(out, &sum);
+    return 0;
+}
+
+// Distribution of the sum of n independent draws from base.
+int distribution_power(const struct distribution *base, long n, struct distribution *out) {
+    if(base->len > 1 && n > (DIST_MAX_SUPPORT - 1)/(base->len - 1)) {
+        fprintf(stderr, "Too many possible outcomes to compute exactly; the limit is %ld.\n", DIST_MAX_SUPPORT);
+        return 1;
+    }
+    struct distribution result;
+    struct distribution square;
+    distribution_init(&result);
+    distribution_init(&square);
+    distribution_point(&result, 0);
+    if(0 != distribution_convolve(base, &result, &square)) { // ie a copy of base
+        distribution_free(&result);
+        return 1;
+    }
+    int err = 0;
+    while(n > 0 && err == 0) {
+        if(n & 1) {
+            err = distribution_convolve(&result, &square, &result);
+        }
+        n >>= 1;
+        if(n > 0 && err == 0) {
+            err = distribution_convolve(&square, &square, &square);
+        }
+    }
+    distribution_free(&square);
+    if(err == 0) {
+        distribution_replace(out, &result);
+    }
+    distribution_free(&result);
+    return err;
+}
+
+/*
+   How many levels of explosion to keep for an exploding die, so that the
+   chance of going any further, written to *tail, is below DIST_EXPLODE_TOLERANCE.
+*/
+long explosion_levels(long nsides, double *tail) {
+    long levels = 1;
+    *tail = 1.0/nsides; // Chance of at least `levels` explosions
+    while(*tail >= DIST_EXPLODE_TOLERANCE) {
+        ++levels;
+        *tail /= nsides;
+    }
+    return levels;
+}
+
+// One die, possibly exploding, truncating explosion chains below DIST_EXPLODE_TOLERANCE.
+int single_dice_distribution(const struct roll_encoding *d, struct distribution *x) {
+    distribution_free(x);
+    if(d->nsides > DIST_MAX_SUPPORT) {
+        fprintf(stderr, "Too many possible outcomes to compute exactly; the limit is %ld.\n", DIST_MAX_SUPPORT);
+        return 1;
+    }
+    long face;
+    if(!d->explode) {
+        if(0 != distribution_alloc(x, 1, d->nsides)) {
+            return 1;
+        }
+        for(face = 0; face < d->nsides; ++face) {
+            x->p[face] = 1.0/d->nsides;
+        }
+        return 0;
+    }
+    double tail;
+    long levels = explosion_levels(d->nsides, &tail);
+    if(levels > DIST_MAX_SUPPORT/d->nsides || 0 != distribution_alloc(x, 1, levels*d->nsides - 1)) {
+        fprintf(stderr, "Too many possible outcomes to compute exactly; the limit is %ld.\n", DIST_MAX_SUPPORT);
+        return 1;
+    }
+    long level;
+    double level_prob = 1.0/d->nsides;
+    for(level = 0; level < levels; ++level) {
+        for(face = 1; face < d->nsides; ++face) {
+            x->p[level*d->nsides + face - 1] = level_prob;
+        }
+        level_prob /= d->nsides;
+    }
+    x->truncated = tail;
+    return 0;
+}
+
+// Whether keep_highest_distribution can keep nkeep dice of faces up to vmax within the support limit and budget.
+bool keep_within_budget(long die_len, long vmax, long nkeep, long budget) {
+    if(nkeep > (DIST_MAX_SUPPORT - 1)/vmax) {
+        return false;
+    }
+    long width = nkeep*vmax + 1;
+    return nkeep + 1 <= DIST_MAX_SUPPORT/width
+        && (double)die_len*nkeep*nkeep*width <= (double)budget*DIST_KEEP_WORK_PER_OUTCOME;
+}
+
+/*
+   Distribution of the total of the highest nkeep of ndice draws from die.
+   Order-statistic dynamic programme: walk the faces from highest to lowest,
+   tracking how many dice have been placed so far (only up to nkeep matters)
+   and what they add up to. At each face, the number of remaining dice that
+   land on it is binomial given that they land on it or lower.
+*/
+int keep_highest_distribution(const struct distribution *die, long ndice, long nkeep, struct distribution *out) {
+    long vmax = die->min + die->len - 1;
+    if(die->min < 0 || !keep_within_budget(die->len, vmax, nkeep, DIST_MAX_SUPPORT)) {
+        fprintf(stderr, "Keeping %ld of %ld dice is too much work to compute exactly.\n", nkeep, ndice);
+        return 1;
+    }
+    long width = nkeep*vmax + 1;
+    double *state = calloc((nkeep + 1)*width, sizeof(double));
+    double *next = calloc((nkeep + 1)*width, sizeof(double));
+    double *cumulative = malloc(sizeof(double)*die->len);
+    double *binom = malloc(sizeof(double)*(nkeep + 1));
+    if(!state || !next || !cumulative || !binom) {
+        fprintf(stderr, "Error allocating memory.\n");
+        exit(1);
+    }
+    long i;
+    double running = 0;
+    for(i = 0; i < die->len; ++i) {
+        running += die->p[i];
+        cumulative[i] = running;
+    }
+    state[0] = 1; // No dice placed, nothing kept
+    for(i = die->len - 1; i >= 0; --i) {
+        if(die->p[i] <= 0) {
+            continue;
+        }
+        long v = die->min + i;
+        double q = die->p[i]/cumulative[i];
+        memset(next, 0, sizeof(double)*nkeep*width);
+        memcpy(next + nkeep*width, state + nkeep*width, sizeof(double)*width);
+        long placed;
+        for(placed = 0; placed < nkeep; ++placed) {
+            long n = ndice - placed;
+            long cmax = n < nkeep - placed - 1 ? n : nkeep - placed - 1;
+            double tail = 1;
+            long c;
+            for(c = 0; c <= cmax; ++c) {
+                if(q >= 1) {
+                    binom[c] = c == n ? 1 : 0;
+                } else {
+                    binom[c] = exp(lgamma(n + 1) - lgamma(c + 1) - lgamma(n - c + 1) + c*log(q) + (n - c)*log1p(-q));
+                }
+                tail -= binom[c];
+            }
+            if(tail < 0 || cmax == n) {
+                tail = 0;
+            }
+            double *row = state + placed*width;
+            long s;
+            for(s = 0; s < width; ++s) {
+                if(row[s] <= 0) {
+                    continue;
+                }
+                for(c = 0; c <= cmax; ++c) {
+                    next[(placed + c)*width + s + c*v] += row[s]*binom[c];
+                }
+                next[nkeep*width + s + (nkeep - placed)*v] += row[s]*tail;
+            }
+        }
+        double *tmp = state;
+        state = next;
+        next = tmp;
+    }
+    distribution_free(out);
+    int err = distribution_alloc(out, 0, width);
+    if(err == 0) {
+        memcpy(out->p, state + nkeep*width, sizeof(double)*width);
+        distribution_trim(out);
+    }
+    free(state);
+    free(next);
+    free(cumulative);
+    free(binom);
+    return err;
+}
+
+// Distribution of the total of one roll_encoding term, ignoring its sign.
+int dice_distribution(const struct roll_encoding *d, struct distribution *x) {
+    if(d->nsides == 1) {
+        return distribution_point(x, d->ndice);
+    }
+    struct distribution die;
+    distribution_init(&die);
+    int err = single_dice_distribution(d, &die);
+    if(err == 0) {
+        long nkeep = d->ndice - d->discard;
+        if(d->discard > 0) {
+            err = keep_highest_distribution(&die, d->ndice, nkeep, x);
+        } else {
+            err = distribution_power(&die, d->ndice, x);
+        }
+        if(err == 0) {
+            x->truncated = 1 - pow(1 - die.truncated, d->ndice);
+        }
+    }
+    distribution_free(&die);
+    return err;
+}
+
+double distribution_at_least(const struct distribution *x, long threshold) {
+    double p = 0;
+    long i = threshold - x->min;
+    for(i = i < 0 ? 0 : i; i < x->len; ++i) {
+        p += x->p[i];
+    }
+    return p > 1 ? 1 : p;
+}
+
+// Number of successes in n trials that each succeed with probability p.
+int binomial_distribution(long n, double p, struct distribution *x) {
+    distribution_free(x);
+    if(n > DIST_MAX_SUPPORT - 1 || 0 != distribution_alloc(x, 0, n + 1)) {
+        fprintf(stderr, "Too many possible outcomes to compute exactly; the limit is %ld.\n", DIST_MAX_SUPPORT);
+        return 1;
+    }
+    long k;
+    for(k = 0; k <= n; ++k) {
+        if(p <= 0) {
+            x->p[k] = k == 0;
+        } else if(p >= 1) {
+            x->p[k] = k == n;
+        } else {
+            x->p[k] = exp(lgamma(n + 1) - lgamma(k + 1) - lgamma(n - k + 1) + k*log(p) + (n - k)*log1p(-p));
+        }
+    }
+    distribution_trim(x);
+    return 0;
+}
+
+/*
+   Roughly how many outcomes expression_distribution would have to hold for
+   t, judged from the shape of its terms alone; 0 if that is over budget.
+*/
+long estimated_support(const struct parse_tree *t, long budget) {
+    if(budget > DIST_MAX_SUPPORT) {
+        budget = DIST_MAX_SUPPORT;
+    }
+    long support = 1;
+    const struct roll_encoding *d;
+    for(d = t->dice_specs; d != NULL; d = d->next) {
+        if(d->ndice <= 0 || d->nsides <= 1) {
+            continue;
+        }
+        long die_support = d->nsides;
+        if(d->explode) {
+            double tail;
+            long levels = explosion_levels(d->nsides, &tail);
+            if(levels > budget/d->nsides) {
+                return 0;
+            }
+            die_support = levels*d->nsides;
+        }
+        long counted = d->ndice - d->discard;
+        if(die_support - 1 > budget || counted > (budget - support)/(die_support - 1)) {
+            return 0;
+        }
+        support += counted*(die_support - 1);
+        if(d->discard > 0 && !keep_within_budget(die_support, die_support, counted, budget)) {
+            return 0;
+        }
+    }
+    return support;
+}
+
+// Exact distribution of the result of a single rep of a statement.
+int expression_distribution(const struct parse_tree *t, struct distribution *x) {
+    distribution_point(x, 0);
+    struct distribution term;
+    distribution_init(&term);
+    const struct roll_encoding *d;
+    for(d = t->dice_specs; d != NULL; d = d->next) {
+        if(d->ndice > 0 && d->nsides > 0) {
+            if(0 != dice_distribution(d, &term)) {
+                distribution_free(&term);
+                return 1;
+            }
+            if(d->dir == neg) {
+                distribution_negate(&term);
+            }
+            if(0 != distribution_convolve(x, &term, x)) {
+                distribution_free(&term);
+                return 1;
+            }
+        }
+    }
+    distribution_free(&term);
+    return 0;
+}
+
+/*
+   Exact distribution of a statement's output: the result of a single rep,
+   or for thresholded statements the number of successes over all reps.
+*/
+int statement_distribution(const struct parse_tree *t, struct distribution *x) {
+    if(0 != expression_distribution(t, x)) {
+        return 1;
+    }
+    if(t->use_threshold) {
+        double truncated = x->truncated;
+        double p = distribution_at_least(x, t->threshold);
+        if(0 != binomial_distribution(t->nreps, p, x)) {
+            return 1;
+        }
+        x->truncated = truncated;
+    }
+    return 0;
+}
+
+void print_distribution(const struct distribution *x) {
+    long i;
+    for(i = 0; i < x->len; ++i) {
+        if(x->p[i] > 0) {
+            char line[64];
+            int len = snprintf(line, sizeof(line), " %.10g\n", x->p[i]);
+            output_long(x->min + i);
+            output_bytes(line, len);
+        }
+    }
+    if(x->truncated > 0) {
+        fprintf(stderr, "Note: explosion chains with total probability %g were left out.\n", x->truncated);
+    }
+}
@@ -0,0 +1,30 @@
+#ifndef __DIST_H__
+#define __DIST_H__
+#include <stdbool.h>
+#include "parse.h"
+
+#define DIST_MAX_SUPPORT (1L << 22) // Most outcomes we are prepared to hold in one distribution
+#define DIST_EXPLODE_TOLERANCE 1e-12 // Explosion chains less likely than this are left out
+#define DIST_KEEP_WORK_PER_OUTCOME 1024 // Keep computations may do this many multiply-adds per outcome allowed
+
+/*
+   Exact probability mass function over a run of consecutive integers:
+   p[i] is the probability of the outcome min + i.
+*/
+struct distribution {
+    long min;
+    long len;
+    double *p;
+    double truncated; // Probability mass left out of long explosion chains
+};
+
+void distribution_init(struct distribution *x);
+void distribution_free(struct distribution *x);
+int distribution_convolve(const struct distribution *a, const struct distribution *b, struct distribution *out);
+int dice_distribution(const struct roll_encoding *d, struct distribution *x);
+long estimated_support(const struct parse_tree *t, long budget);
+int expression_distribution(const struct parse_tree *t, struct distribution *x);
+int statement_distribution(const struct parse_tree *t, struct distribution *x);
+double distribution_at_least(const struct distribution *x, long threshold);
+void print_distribution(const struct distribution *x);
+#endif // __DIST_H__
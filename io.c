@@ -6,39 +6,583 @@
 #include <readline/history.h>
 #include <wordexp.h> // Needed to expand out history path eg involving '~'
 #include <errno.h>
+#include <unistd.h>
+#include <stdio_ext.h> // Needed for __fpending
+#include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 
 #include "io.h"
+#include "cache.h"
+#include "checkpoint.h"
+#include "dist.h"
 #include "parse.h"
 #include "roll-engine.h"
 
+#define OUT_BUFFER_INITIAL_CAPACITY 4096
+#define OUTPUT_FLUSH_THRESHOLD (1 << 20) // Results are written out in chunks of about this many bytes
+
+/*
+   Results bypass stdio: they are formatted into a large buffer by hand and
+   handed to the kernel with write/writev once it fills up, or at the end
+   of an interactive line.
+*/
+struct out_buffer output = { NULL, 0, 0 };
+int output_fd = STDOUT_FILENO;
+
+static const char digit_pairs[201] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
+
+// Write the decimal form of n to dst, two digits at a time, returning its length.
+size_t format_long(char *dst, long n) {
+    char tmp[LONG_MAX_STR_LEN + 1];
+    char *end = tmp + sizeof(tmp);
+    char *p = end;
+    unsigned long u = n < 0 ? -(unsigned long)n : (unsigned long)n;
+    while(u >= 100) {
+        unsigned long pair = (u % 100)*2;
+        u /= 100;
+        *--p = digit_pairs[pair + 1];
+        *--p = digit_pairs[pair];
+    }
+    if(u >= 10) {
+        *--p = digit_pairs[u*2 + 1];
+        *--p = digit_pairs[u*2];
+    } else {
+        *--p = '0' + u;
+    }
+    size_t len = 0;
+    if(n < 0) {
+        dst[len++] = '-';
+    }
+    memcpy(dst + len, p, end - p);
+    return len + (end - p);
+}
+
+void out_buffer_init(struct out_buffer *b) {
+    b->data = NULL;
+    b->len = 0;
+    b->capacity = 0;
+}
+
+void out_buffer_free(struct out_buffer *b) {
+    free(b->data);
+    out_buffer_init(b);
+}
+
+void out_buffer_reserve(struct out_buffer *b, size_t extra) {
+    if(b->len + extra <= b->capacity) {
+        return;
+    }
+    size_t capacity = b->capacity > 0 ? b->capacity : OUT_BUFFER_INITIAL_CAPACITY;
+    while(capacity < b->len + extra) {
+        capacity *= 2;
+    }
+    char *data = realloc(b->data, capacity);
+    if(!data) {
+        fprintf(stderr, "Error allocating memory.\n");
+        exit(1);
+    }
+    b->data = data;
+    b->capacity = capacity;
+}
+
+void out_buffer_char(struct out_buffer *b, char c) {
+    out_buffer_reserve(b, 1);
+    b->data[b->len++] = c;
+}
+
+void out_buffer_long(struct out_buffer *b, long n) {
+    out_buffer_reserve(b, LONG_MAX_STR_LEN + 2);
+    b->len += format_long(b->data + b->len, n);
+}
+
+void out_buffer_bytes(struct out_buffer *b, const char *s, size_t len) {
+    out_buffer_reserve(b, len);
+    memcpy(b->data + b->len, s, len);
+    b->len += len;
+}
+
+uint64_t output_written = 0; // Bytes of results written out so far
+
+// Hand all of iov to the kernel, coping with short writes and interruptions.
+void writev_all(int fd, struct iovec *iov, int iovcnt) {
+    while(iovcnt > 0) {
+        ssize_t written = writev(fd, iov, iovcnt);
+        if(written < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "Error %d (%s) writing results.\n", errno, strerror(errno));
+            return;
+        }
+        output_written += written;
+        while(iovcnt > 0 && (size_t)written >= iov->iov_len) {
+            written -= iov->iov_len;
+            ++iov;
+            --iovcnt;
+        }
+        if(iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+}
+
+/*
+   With --output-file the results buffer is the file itself, mapped into
+   memory: output.data points into the mapping, output.capacity is the size
+   of the file so far and output.len how much of it holds results. The file
+   grows by doubling and is cut back to output.len when it is closed.
+*/
+#define OUTPUT_MAP_INITIAL_SIZE (1L << 24)
+
+bool output_mapped = false;
+bool output_to_terminal = false; // Results are shown as each line is rolled rather than a buffer at a time
+
+void output_map_grow(size_t extra) {
+    size_t capacity = output.capacity;
+    while(capacity < output.len + extra) {
+        capacity *= 2;
+    }
+    if(ftruncate(output_fd, capacity) != 0) {
+        fprintf(stderr, "Error %d (%s) growing the output file.\n", errno, strerror(errno));
+        exit(1);
+    }
+    void *data = mremap(output.data, output.capacity, capacity, MREMAP_MAYMOVE);
+    if(data == MAP_FAILED) {
+        fprintf(stderr, "Error %d (%s) mapping the output file.\n", errno, strerror(errno));
+        exit(1);
+    }
+    output.data = data;
+    output.capacity = capacity;
+}
+
+void output_flush() {
+    if(output_mapped) {
+        return;
+    }
+    if(output.len > 0) {
+        struct iovec iov = { output.data, output.len };
+        writev_all(output_fd, &iov, 1);
+    }
+    output.len = 0;
+}
+
+// Make room for extra more bytes of results, writing out what is pending if need be.
+void output_reserve(size_t extra) {
+    if(output_mapped) {
+        if(output.len + extra > output.capacity) {
+            output_map_grow(extra);
+        }
+    } else {
+        if(output.len + extra > OUTPUT_FLUSH_THRESHOLD) {
+            output_flush();
+        }
+        out_buffer_reserve(&output, extra);
+    }
+}
+
+void output_char(char c) {
+    output_reserve(1);
+    output.data[output.len++] = c;
+}
+
+void output_long(long n) {
+    output_reserve(LONG_MAX_STR_LEN + 2);
+    output.len += format_long(output.data + output.len, n);
+}
+
+void output_bytes(const char *s, size_t len) {
+    output_reserve(len);
+    memcpy(output.data + output.len, s, len);
+    output.len += len;
+}
+
+/*
+   Write out the pending output followed by each of buffers in turn, in one
+   writev where possible. If they are small they join the pending output
+   instead, so a run of short statements does not cost a system call each.
+*/
+#define OUTPUT_MAX_IOV 64
+
+void output_buffers(struct out_buffer *buffers, int nbuffers) {
+    int i;
+    size_t total = output.len;
+    for(i = 0; i < nbuffers; ++i) {
+        total += buffers[i].len;
+    }
+    if(output_mapped || total <= OUTPUT_FLUSH_THRESHOLD) {
+        for(i = 0; i < nbuffers; ++i) {
+            output_bytes(buffers[i].data, buffers[i].len);
+            buffers[i].len = 0;
+        }
+        return;
+    }
+    struct iovec iov[OUTPUT_MAX_IOV];
+    int iovcnt = 0;
+    if(output.len > 0) {
+        iov[iovcnt].iov_base = output.data;
+        iov[iovcnt].iov_len = output.len;
+        ++iovcnt;
+    }
+    for(i = 0; i < nbuffers; ++i) {
+        if(buffers[i].len == 0) {
+            continue;
+        }
+        if(iovcnt == OUTPUT_MAX_IOV) {
+            writev_all(output_fd, iov, iovcnt);
+            iovcnt = 0;
+        }
+        iov[iovcnt].iov_base = buffers[i].data;
+        iov[iovcnt].iov_len = buffers[i].len;
+        ++iovcnt;
+    }
+    writev_all(output_fd, iov, iovcnt);
+    output.len = 0;
+    for(i = 0; i < nbuffers; ++i) {
+        buffers[i].len = 0;
+    }
+}
+
+/*
+   Messages such as parse errors still go through stdio. If any are waiting
+   behind results we have buffered, write ours out first to keep them in order.
+*/
+void output_sync() {
+    if(__fpending(stdout) > 0) {
+        output_flush();
+        fflush(stdout);
+    }
+}
+
+/*
+   Each statement's results are a run of values. As text they are written
+   in decimal separated by spaces and ended with a newline. The binary
+   formats write every value little-endian at a fixed width with no
+   separators, and the columnar format puts a header in front of the whole
+   file and in front of each statement's run, so readers can find the
+   columns without knowing the statements:
+
+     file header:   "DICECOLS"  u32 version (1)  u32 value width (8)
+     column header: u32 kind (0 rolls, 1 success count)  u32 reserved (0)  u64 count
+     column body:   count int64 values
+
+   A statement cut short by SIGINT is padded to its full length with the
+   smallest value of the format, so the layout stays predictable.
+*/
+enum output_format output_format = OUTPUT_TEXT;
+long statement_expected = 0;
+long statement_written = 0;
+bool int32_clamp_warned = false;
+
+void put_le32(char *dst, uint32_t v) {
+    dst[0] = v;
+    dst[1] = v >> 8;
+    dst[2] = v >> 16;
+    dst[3] = v >> 24;
+}
+
+void put_le64(char *dst, uint64_t v) {
+    put_le32(dst, v);
+    put_le32(dst + 4, v >> 32);
+}
+
+size_t output_value_width() {
+    switch(output_format) {
+        case OUTPUT_INT32:
+            return 4;
+        case OUTPUT_INT64: case OUTPUT_COLUMNAR:
+            return 8;
+        default:
+            return 0;
+    }
+}
+
+// Store n at dst in the current binary format.
+void output_put_value(char *dst, long n) {
+    if(output_format == OUTPUT_INT32) {
+        if(n > INT32_MAX || n <= INT32_MIN) {
+            if(!int32_clamp_warned) {
+                fprintf(stderr, "Warning: results outside the int32 range are clamped.\n");
+                int32_clamp_warned = true;
+            }
+            n = n > 0 ? INT32_MAX : INT32_MIN + 1;
+        }
+        put_le32(dst, (uint32_t)n);
+    } else {
+        put_le64(dst, (uint64_t)n);
+    }
+}
+
+void output_put_missing(char *dst) {
+    if(output_format == OUTPUT_INT32) {
+        put_le32(dst, (uint32_t)INT32_MIN);
+    } else {
+        put_le64(dst, (uint64_t)INT64_MIN);
+    }
+}
+
+void output_begin_statement(long count, bool successes) {
+    statement_expected = count;
+    statement_written = 0;
+    if(output_format == OUTPUT_COLUMNAR) {
+        output_reserve(16);
+        put_le32(output.data + output.len, successes ? 1 : 0);
+        put_le32(output.data + output.len + 4, 0);
+        put_le64(output.data + output.len + 8, count);
+        output.len += 16;
+    }
+}
+
+void output_value(long n) {
+    if(output_format == OUTPUT_TEXT) {
+        if(statement_written > 0) {
+            output_char(' ');
+        }
+        output_long(n);
+    } else {
+        size_t width = output_value_width();
+        output_reserve(width);
+        output_put_value(output.data + output.len, n);
+        output.len += width;
+    }
+    ++statement_written;
+}
+
+// Append n to b in the current binary format.
+void out_buffer_value(struct out_buffer *b, long n) {
+    size_t width = output_value_width();
+    out_buffer_reserve(b, width);
+    output_put_value(b->data + b->len, n);
+    b->len += width;
+}
+
+void out_buffer_missing(struct out_buffer *b) {
+    size_t width = output_value_width();
+    out_buffer_reserve(b, width);
+    output_put_missing(b->data + b->len);
+    b->len += width;
+}
+
+// Results formatted into buffers of their own and written with output_buffers are counted this way.
+void output_count_values(long n) {
+    statement_written += n;
+}
+
+// Pick up a statement that a checkpoint left with written of its count values already out.
+void output_resume_statement(long count, long written) {
+    statement_expected = count;
+    statement_written = written;
+}
+
+void output_end_statement() {
+    if(output_format == OUTPUT_TEXT) {
+        output_char('\n');
+        return;
+    }
+    size_t width = output_value_width();
+    while(statement_written < statement_expected) {
+        output_reserve(width);
+        output_put_missing(output.data + output.len);
+        output.len += width;
+        ++statement_written;
+    }
+}
+
+/*
+   Opens the output. When resuming from a checkpoint, resume_offset is how
+   much of the output file the interrupted run had finished; the file is
+   kept up to there and written on from that point.
+*/
+int output_open(enum output_format format, const char *path, uint64_t resume_offset) {
+    output_format = format;
+    if(path != NULL) {
+        errno = 0;
+        output_fd = open(path, O_RDWR | O_CREAT | (resume_offset > 0 ? 0 : O_TRUNC), 0666);
+        if(output_fd < 0) {
+            fprintf(stderr, "Error %d (%s) opening output file %s\n", errno, strerror(errno), path);
+            return 1;
+        }
+        struct stat st;
+        if(fstat(output_fd, &st) != 0 || (uint64_t)st.st_size < resume_offset) {
+            fprintf(stderr, "The output file %s is shorter than the checkpoint says.\n", path);
+            return 1;
+        }
+        size_t capacity = OUTPUT_MAP_INITIAL_SIZE;
+        while(capacity < resume_offset) {
+            capacity *= 2;
+        }
+        if(ftruncate(output_fd, capacity) != 0) {
+            fprintf(stderr, "Error %d (%s) growing the output file.\n", errno, strerror(errno));
+            return 1;
+        }
+        void *data = mmap(NULL, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, output_fd, 0);
+        if(data == MAP_FAILED) {
+            fprintf(stderr, "Error %d (%s) mapping the output file.\n", errno, strerror(errno));
+            return 1;
+        }
+        output.data = data;
+        output.len = resume_offset;
+        output.capacity = capacity;
+        output_mapped = true;
+    }
+    output_to_terminal = isatty(output_fd);
+    if(format == OUTPUT_COLUMNAR && output_position() == 0) {
+        output_bytes("DICECOLS", 8);
+        output_reserve(8);
+        put_le32(output.data + output.len, 1);
+        put_le32(output.data + output.len + 4, 8);
+        output.len += 8;
+    }
+    return 0;
+}
+
+// Bytes of results handed over so far, including any still buffered.
+uint64_t output_position() {
+    return output_written + output.len;
+}
+
+// Make sure everything up to output_position() has reached the output, eg before a checkpoint records it.
+void output_checkpoint() {
+    if(output_mapped) {
+        if(msync(output.data, output.len, MS_SYNC) != 0) {
+            fprintf(stderr, "Error %d (%s) syncing the output file.\n", errno, strerror(errno));
+        }
+    } else {
+        output_flush();
+    }
+}
+
+void output_close() {
+    output_flush();
+    if(output_mapped) {
+        munmap(output.data, output.capacity);
+        if(ftruncate(output_fd, output.len) != 0) {
+            fprintf(stderr, "Error %d (%s) truncating the output file.\n", errno, strerror(errno));
+        }
+        close(output_fd);
+        out_buffer_init(&output);
+        output_mapped = false;
+    } else {
+        out_buffer_free(&output);
+    }
+}
+
+// Defaults for everything the command line can change.
+void arguments_init(struct arguments *args) {
+    args->prompt = "\001\e[0;32m\002dice> \001\e[0m\002";
+    args->mode = isatty(fileno(stdin)) ? INTERACTIVE : PIPE;
+    args->ist = stdin;
+    args->seed = 0;
+    args->seed_set = false;
+    args->exact = false;
+    args->aggregate = false;
+    args->exact_budget = DIST_MAX_SUPPORT;
+    args->output_format = OUTPUT_TEXT;
+    args->output_file = NULL;
+    args->shard_index = 0;
+    args->shard_count = 0;
+    args->checkpoint_file = NULL;
+    args->checkpoint_interval = CHECKPOINT_DEFAULT_INTERVAL;
+    args->resume = false;
+    args->cache_size = STATEMENT_CACHE_DEFAULT_SIZE;
+    args->cache_stats = false;
+    args->calibrate = false;
+    args->threads = 0;
+    args->affinity.policy = AFFINITY_NONE;
+    args->affinity.ncpus = 0;
+}
+
+void roll_statements(struct parse_tree *t, struct arguments *args) {
+    struct parse_tree *s;
+    for(s = t; s != NULL; s = s->next) {
+        if(args->exact) {
+            s->exact = true;
+        }
+        if(args->aggregate) {
+            s->aggregate = true;
+        }
+    }
+    roll_line(t, args);
+}
+
+// Kept from line to line, so getline only reallocates for a longer line than any before.
+char *input_line = NULL;
+size_t input_line_size = 0;
+
+/*
+   Whether nothing more is ready to be read from ist, so reading the next
+   line may wait on whatever feeds it. Lines stdio has already buffered are
+   not counted, so this errs on the side of flushing. A regular file never
+   keeps us waiting, so it is only looked at once rather than polled for
+   every line.
+*/
+FILE *input_checked = NULL;
+bool input_regular = false;
+
+bool input_drained(FILE *ist) {
+    if(ist != input_checked) {
+        struct stat st;
+        input_checked = ist;
+        input_regular = fstat(fileno(ist), &st) == 0 && S_ISREG(st.st_mode);
+    }
+    if(input_regular) {
+        return false;
+    }
+    struct pollfd pfd = { fileno(ist), POLLIN, 0 };
+    return poll(&pfd, 1, 0) <= 0;
+}
+
 void getline_wrapper(struct parse_tree *t, struct arguments *args) {
-    size_t bufsize = 0;
-    char *line = NULL;
     errno = 0;
-    int getline_retval = getline(&line, &bufsize, args->ist);
-    if(line == NULL || line == 0 || feof(args->ist) || errno != 0 || getline_retval < 0) {
+    int getline_retval = getline(&input_line, &input_line_size, args->ist);
+    if(input_line == NULL || feof(args->ist) || errno != 0 || getline_retval < 0) {
         if(errno != 0) {
             printf("Error %d (%s) getting line for reading.\n", errno, strerror(errno));
         }
         t->quit = true;
-        goto end_of_getline;
+        free(input_line);
+        input_line = NULL;
+        input_line_size = 0;
+        return;
     }
-    parse(t, line, bufsize);
-    t->current = t;
-    while(t->current != NULL) {
-        if(!t->current->suppress) {
-            roll(t->current);
-        }
-        t->current = t->current->next;
+    int parse_status;
+    struct parse_tree *statements = parse_cached(t, input_line, input_line_size, &parse_status);
+    output_sync();
+    roll_statements(statements, args);
+    // Someone may be waiting on these results, eg at a terminal or at the end of `tail -f log | dice`.
+    if(output_to_terminal || input_drained(args->ist)) {
+        output_flush();
     }
-end_of_getline:
-    free(line);
 }
 
 void no_read(struct parse_tree *t, struct arguments *args) {
     printf("Unknown mode. Not reading any lines.\n");
 }
 
+// Roll a line typed at the prompt, showing its results straight away, and return how it parsed.
+int interactive_line(struct parse_tree *t, const char *line, size_t len, struct arguments *args) {
+    int parse_status;
+    struct parse_tree *statements = parse_cached(t, line, len, &parse_status);
+    fflush(stdout);
+    roll_statements(statements, args);
+    output_flush();
+    return parse_status;
+}
+
 void readline_wrapper(struct parse_tree *t, struct arguments *args) {
     char *line = readline(args->prompt);
     if(line == NULL || line == 0) {
@@ -46,16 +590,7 @@ void readline_wrapper(struct parse_tree *t, struct arguments *args) {
         t->quit = true;
         goto end_of_readline;
     }
-    size_t bufsize = strlen(line);
-    int parse_success = parse(t, line, bufsize);
-    t->current = t;
-    while(t->current != NULL) {
-        if(!t->current->suppress) {
-            roll(t->current);
-        }
-        t->current = t->current->next;
-    }
-    if(0 == parse_success) {
+    if(0 == interactive_line(t, line, strlen(line), args)) {
         add_history(line);
     }
 end_of_readline:
@@ -76,7 +611,7 @@ void read_history_wrapper(const char *filename) {
             break;
     }
     char **path = matched_paths.we_wordv;
-    int path_num = 0;
+    size_t path_num = 0;
     for(path_num = 0; path_num < matched_paths.we_wordc; ++path_num) {
         errno = 0;
         read_history(path[path_num]);
@@ -107,7 +642,7 @@ void write_history_wrapper(const char *filename) {
             break;
     }
     char **path = matched_paths.we_wordv;
-    int path_num = 0;
+    size_t path_num = 0;
     for(path_num = 0; path_num < matched_paths.we_wordc; ++path_num) {
         errno = 0;
         write_history(path[path_num]);
@@ -2,7 +2,9 @@
 #define __IO_H__
 #include <stdio.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include "parse.h"
+#include "threads.h"
 
 typedef enum invocation_type {
     INTERACTIVE = 0,
@@ -10,16 +12,78 @@ typedef enum invocation_type {
     PIPE
 } invocation_type;
 
+enum output_format {
+    OUTPUT_TEXT = 0,
+    OUTPUT_INT64,
+    OUTPUT_INT32,
+    OUTPUT_COLUMNAR
+};
+
 struct arguments {
     char *prompt;
     invocation_type mode;
-    unsigned int seed;
+    uint64_t seed;
     bool seed_set;
+    bool exact;
+    bool aggregate;
+    long exact_budget;
+    enum output_format output_format;
+    char *output_file;
+    long shard_index;
+    long shard_count; // 0 unless the reps are split over several processes with --shard
+    char *checkpoint_file;
+    long checkpoint_interval;
+    bool resume;
+    long cache_size;
+    bool cache_stats;
+    bool calibrate;
+    int threads; // 0 leaves it to OpenMP
+    struct affinity affinity;
     FILE *ist;
 };
 
+// Growable text buffer, eg for one thread's share of a statement's output.
+struct out_buffer {
+    char *data;
+    size_t len;
+    size_t capacity;
+};
+
+void out_buffer_init(struct out_buffer *b);
+void out_buffer_free(struct out_buffer *b);
+void out_buffer_reserve(struct out_buffer *b, size_t extra);
+void out_buffer_char(struct out_buffer *b, char c);
+void out_buffer_long(struct out_buffer *b, long n);
+void out_buffer_bytes(struct out_buffer *b, const char *s, size_t len);
+size_t format_long(char *dst, long n);
+void output_char(char c);
+void output_long(long n);
+void output_bytes(const char *s, size_t len);
+void output_buffers(struct out_buffer *buffers, int nbuffers);
+void output_flush();
+void output_sync();
+extern enum output_format output_format;
+void put_le32(char *dst, uint32_t v);
+void put_le64(char *dst, uint64_t v);
+size_t output_value_width();
+void output_put_value(char *dst, long n);
+void output_put_missing(char *dst);
+void out_buffer_value(struct out_buffer *b, long n);
+void out_buffer_missing(struct out_buffer *b);
+void output_begin_statement(long count, bool successes);
+void output_value(long n);
+void output_count_values(long n);
+void output_end_statement();
+void output_resume_statement(long count, long written);
+int output_open(enum output_format format, const char *path, uint64_t resume_offset);
+uint64_t output_position();
+void output_checkpoint();
+void output_close();
+void arguments_init(struct arguments *args);
+void roll_statements(struct parse_tree *t, struct arguments *args);
 void getline_wrapper(struct parse_tree *t, struct arguments *args);
 void no_read(struct parse_tree *t, struct arguments *args);
+int interactive_line(struct parse_tree *t, const char *line, size_t len, struct arguments *args);
 void readline_wrapper(struct parse_tree *t, struct arguments *args);
 void read_history_wrapper(const char *filename);
 void write_history_wrapper(const char *filename);
@@ -6,16 +6,19 @@
 #include <limits.h>
 #include <termcap.h> // Needed for clear_screen
 #include <errno.h>
-#include <omp.h>
+#include "arena.h"
 #include "parse.h"
+#include "program.h"
 #include "roll-engine.h"
 
 static const struct cmd_map commands[] = {
     { quit, { "quit" } },
     { clear, { "clear" } },
+    { exact, { "exact" } },
+    { aggregate, { "aggregate" } },
+    { explain, { "explain" } },
 };
-#define NUMBER_OF_DEFINED_COMMANDS 2
-#define CMD_MAX_STR_LEN 5
+#define NUMBER_OF_DEFINED_COMMANDS 5
 
 void clear_screen() {
     char buf[1024];
@@ -26,155 +29,89 @@ void clear_screen() {
     fputs(str, stdout);
 }
 
-void token_list_init(struct token *t, const size_t len) {
-    int toknum;
-    #pragma omp for schedule(static) private(toknum) nowait
-    for(toknum = 0; toknum < len; ++toknum) {
-        t[toknum].type = none;
-        t[toknum].number = 0;
-        t[toknum].op = '?';
-        t[toknum].cmd = -1;
-    }
+void token_init(struct token *t) {
+    t->type = none;
+    t->number = 0;
+    t->op = '?';
+    t->cmd = -1;
 }
 
-int lex(struct token *t, int *tokens_found, const char *buf, const size_t len) {
-    int charnum = 0;
-    *tokens_found = 0;
-    while(*(buf + charnum) != '\0' && charnum <= len) {
-        if(isspace(*(buf + charnum))) {
-            ++charnum;
-        } else if(*(buf + charnum) == '#') { //comment detected
-            break;
-        } else {
-            switch(*(buf + charnum)) {
-                case 'd': case 'D':
-                    {
-                        t[*tokens_found].type = dice_operator;
-                        t[*tokens_found].op = *(buf + charnum);
-                        ++charnum;
-                    }
-                    break;
-                case '+': case '-':
-                    {
-                        t[*tokens_found].type = additive_operator;
-                        t[*tokens_found].op = *(buf + charnum);
-                        ++charnum;
-                    }
-                    break;
-                case 'x': case 'X':
-                    {
-                        t[*tokens_found].type = rep_operator;
-                        t[*tokens_found].op = *(buf + charnum);
-                        ++charnum;
-                    }
-                    break;
-                case '!':
-                    {
-                        t[*tokens_found].type = explode_operator;
-                        t[*tokens_found].op = *(buf + charnum);
-                        ++charnum;
-                    }
-                    break;
-                case 't': case 'T': case '>':
-                    {
-                        t[*tokens_found].type = threshold_operator;
-                        t[*tokens_found].op = *(buf + charnum);
-                        ++charnum;
-                    }
-                    break;
-                case 'k': case 'K':
-                    {
-                        t[*tokens_found].type = keep_operator;
-                        t[*tokens_found].op = *(buf + charnum);
-                        ++charnum;
-                    }
-                    break;
-                case ';':
-                    {
-                        t[*tokens_found].type = statement_delimiter;
-                        t[*tokens_found].op = *(buf + charnum);
-                        ++charnum;
+/*
+   Read the token starting at buf[*pos] into t and move *pos past it. At
+   the end of the line, or at a comment, t is eol. Numbers are accumulated
+   digit by digit and command words matched where they lie, so lexing needs
+   no memory beyond t however long the line is.
+*/
+int lex(struct token *t, const char *buf, const size_t len, size_t *pos) {
+    token_init(t);
+    while(*pos < len && buf[*pos] != '\0' && isspace(buf[*pos])) {
+        ++(*pos);
+    }
+    if(*pos >= len || buf[*pos] == '\0' || buf[*pos] == '#') {
+        t->type = eol;
+        return 0;
+    }
+    char c = buf[*pos];
+    switch(c) {
+        case 'd': case 'D':
+            t->type = dice_operator;
+            break;
+        case '+': case '-':
+            t->type = additive_operator;
+            break;
+        case 'x': case 'X':
+            t->type = rep_operator;
+            break;
+        case '!':
+            t->type = explode_operator;
+            break;
+        case 't': case 'T': case '>':
+            t->type = threshold_operator;
+            break;
+        case 'k': case 'K':
+            t->type = keep_operator;
+            break;
+        case ';':
+            t->type = statement_delimiter;
+            break;
+        default:
+            if(isdigit(c)) {
+                long num = 0;
+                while(*pos < len && isdigit(buf[*pos])) {
+                    int digit = buf[*pos] - '0';
+                    if(num > (LONG_MAX - digit)/10) {
+                        printf("Invalid numeric input detected. The maximum number allowed is %ld (LONG_MAX).\n", LONG_MAX);
+                        return 1;
                     }
-                    break;
-                default:
-                    {
-                        char *tok_str;
-                        int offset = charnum;
-                        if(isdigit(*(buf + charnum))) {
-                            tok_str = malloc((LONG_MAX_STR_LEN + 1)*sizeof(char));
-                            if(!tok_str) {
-                                fprintf(stderr, "Error allocating memory.\n");
-                                exit(1);
-                            }
-                            memset(tok_str, 0, LONG_MAX_STR_LEN + 1);
-                            while(isdigit(*(buf + charnum)) && charnum - offset < LONG_MAX_STR_LEN) {
-                                tok_str[charnum - offset] = *(buf + charnum);
-                                ++charnum;
-                            }
-                            if(charnum - offset >= LONG_MAX_STR_LEN && isdigit(*(buf + charnum))) {
-                                printf("Invalid numeric input detected. The maximum number allowed is %ld (LONG_MAX).\n", LONG_MAX);
-                                free(tok_str);
-                                return 1;
-                            }
-                            tok_str[charnum - offset] = '\0';
-                            errno = 0;
-                            long num = strtol(tok_str, NULL, 10);
-                            if((errno == ERANGE && (num == LONG_MAX || num == LONG_MIN))
-                                || (errno != 0 && num == 0)) {
-                                printf("Error %d (%s) converting string '%s' to number.\n", errno, strerror(errno), tok_str);
-                                return 1;
-                            }
-                            t[*tokens_found].type = number;
-                            t[*tokens_found].number = num;
-                        } else if(isalpha(*(buf + charnum))) {
-                            int numchars = 0;
-                            while(isalpha(*(buf + charnum))) {
-                                ++numchars;
-                                ++charnum;
-                            }
-                            tok_str = malloc((numchars + 1)*sizeof(char));
-                            if(!tok_str) {
-                                fprintf(stderr, "Error allocating memory.\n");
-                                exit(1);
-                            }
-                            memset(tok_str, 0, numchars + 1);
-                            charnum = offset;
-                            while(isalpha(*(buf + charnum)) && charnum - offset < numchars) {
-                                tok_str[charnum - offset] = *(buf + charnum);
-                                ++charnum;
-                            }
-                            tok_str[charnum - offset] = '\0';
-                            t[*tokens_found].type = command;
-                            int cmd_num = 0;
-                            bool cmd_found = false;
-                            int max_str_len = CMD_MAX_STR_LEN >= numchars ? CMD_MAX_STR_LEN : numchars;
-                            while(cmd_num < NUMBER_OF_DEFINED_COMMANDS) {
-                                if(0 == strncmp(tok_str, commands[cmd_num].cmd_str, max_str_len)) {
-                                    t[*tokens_found].cmd = commands[cmd_num].cmd_code;
-                                    cmd_found = true;
-                                    break;
-                                }
-                                ++cmd_num;
-                            }
-                            if(!cmd_found) {
-                                printf("Unknown command: %s\n", tok_str);
-                                return 1;
-                            }
-                        } else {
-                            printf("Unknown token detected: %c\n", *(buf + charnum));
-                            return 1;
-                        }
-                        if(tok_str) {
-                            free(tok_str);
-                            tok_str = NULL;
-                        }
+                    num = num*10 + digit;
+                    ++(*pos);
+                }
+                t->type = number;
+                t->number = num;
+            } else if(isalpha(c)) {
+                size_t offset = *pos;
+                while(*pos < len && isalpha(buf[*pos])) {
+                    ++(*pos);
+                }
+                size_t numchars = *pos - offset;
+                t->type = command;
+                int cmd_num;
+                for(cmd_num = 0; cmd_num < NUMBER_OF_DEFINED_COMMANDS; ++cmd_num) {
+                    if(numchars == strlen(commands[cmd_num].cmd_str) && 0 == strncmp(buf + offset, commands[cmd_num].cmd_str, numchars)) {
+                        t->cmd = commands[cmd_num].cmd_code;
+                        return 0;
                     }
+                }
+                printf("Unknown command: %.*s\n", (int)numchars, buf + offset);
+                return 1;
+            } else {
+                printf("Unknown token detected: %c\n", c);
+                return 1;
             }
-            (*tokens_found)++;
-        }
+            return 0;
     }
-    t[*tokens_found].type = eol;
-    ++(*tokens_found);
+    t->op = c;
+    ++(*pos);
     return 0;
 }
 
@@ -288,6 +225,18 @@ void print_parse_tree(const struct parse_tree *t) {
     printf("'}");
 }
 
+// Start a new term at the end of the statement's dice.
+void append_roll(struct parse_tree *t) {
+    struct roll_encoding *d = arena_alloc(t->arena, sizeof(struct roll_encoding));
+    dice_init(d);
+    if(t->last_roll == NULL) {
+        t->dice_specs = d;
+    } else {
+        t->last_roll->next = d;
+    }
+    t->last_roll = d;
+}
+
 void process_none(struct token *tok, struct parse_tree *t, state_t *s, long* tmp) {
     printf("Nothing to do.\n");
     *s = error;
@@ -305,13 +254,8 @@ void process_number(struct token *tok, struct parse_tree *t, state_t *s, long* t
             *s = check_dice_operator;
             break;
         case want_number_of_sides:
-            if(tok->number > RAND_MAX) {
-                *s = error;
-                printf("The maximum number of sides a dice can have is %d (RAND_MAX).\n", RAND_MAX);
-            } else {
-                *s = check_modifiers_or_more_rolls;
-                t->last_roll->nsides = tok->number;
-            }
+            *s = check_modifiers_or_more_rolls;
+            t->last_roll->nsides = tok->number;
             break;
         case check_number_of_dice:
             if(tok->number > LONG_MAX) {
@@ -352,40 +296,19 @@ void process_number(struct token *tok, struct parse_tree *t, state_t *s, long* t
 void process_dice_operator(struct token *tok, struct parse_tree *t, state_t *s, long* tmp) {
     switch(*s) {
         case start:
-            if(t->last_roll == NULL) {
-                t->dice_specs = malloc(sizeof(struct roll_encoding));
-                t->last_roll = t->dice_specs;
-            } else {
-                t->last_roll->next = malloc(sizeof(struct roll_encoding));
-                t->last_roll = t->last_roll->next;
-            }
-            dice_init(t->last_roll);
+            append_roll(t);
             t->last_roll->ndice = 1;
             t->ndice += 1;
             *s = want_number_of_sides;
             break;
         case want_roll:
-            if(t->last_roll == NULL) {
-                t->dice_specs = malloc(sizeof(struct roll_encoding));
-                t->last_roll = t->dice_specs;
-            } else {
-                t->last_roll->next = malloc(sizeof(struct roll_encoding));
-                t->last_roll = t->last_roll->next;
-            }
-            dice_init(t->last_roll);
+            append_roll(t);
             t->last_roll->ndice = 1;
             t->ndice += 1;
             *s = want_number_of_sides;
             break;
         case decide_reps_or_rolls:
-            if(t->last_roll == NULL) {
-                t->dice_specs = malloc(sizeof(struct roll_encoding));
-                t->last_roll = t->dice_specs;
-            } else {
-                t->last_roll->next = malloc(sizeof(struct roll_encoding));
-                t->last_roll = t->last_roll->next;
-            }
-            dice_init(t->last_roll);
+            append_roll(t);
             t->last_roll->ndice = *tmp;
             t->ndice += *tmp;
             *s = want_number_of_sides;
@@ -410,14 +333,7 @@ void process_rep_operator(struct token *tok, struct parse_tree *t, state_t *s, l
         case decide_reps_or_rolls:
             t->nreps = *tmp;
             *s = want_roll;
-            if(t->last_roll == NULL) {
-                t->dice_specs = malloc(sizeof(struct roll_encoding));
-                t->last_roll = t->dice_specs;
-            } else {
-                t->last_roll->next = malloc(sizeof(struct roll_encoding));
-                t->last_roll = t->last_roll->next;
-            }
-            dice_init(t->last_roll);
+            append_roll(t);
             break;
         default:
             printf("Cannot process operator '%c' while in state '", tok->op);
@@ -431,53 +347,28 @@ void process_additive_operator(struct token *tok, struct parse_tree *t, state_t
     switch(*s) {
         case start:
             *s = check_number_of_dice;
-            if(t->last_roll == NULL) {
-                t->dice_specs = malloc(sizeof(struct roll_encoding));
-                t->last_roll = t->dice_specs;
-            } else {
-                t->last_roll->next = malloc(sizeof(struct roll_encoding));
-                t->last_roll = t->last_roll->next;
-            }
-            dice_init(t->last_roll);
+            append_roll(t);
             t->last_roll->dir = tok->op == '+' ? pos : neg;
             break;
         case check_modifiers_or_more_rolls: case check_more_rolls:
             *s = check_number_of_dice;
-            if(t->last_roll == NULL) {
-                t->dice_specs = malloc(sizeof(struct roll_encoding));
-                t->last_roll = t->dice_specs;
-            } else {
-                t->last_roll->next = malloc(sizeof(struct roll_encoding));
-                t->last_roll = t->last_roll->next;
-            }
-            dice_init(t->last_roll);
+            append_roll(t);
             t->last_roll->dir = tok->op == '+' ? pos : neg;
             break;
         case decide_reps_or_rolls: // Deal with cases like 1+2d4. Need to process first number then set things up for the following.
-            if(t->last_roll == NULL) {
-                t->dice_specs = malloc(sizeof(struct roll_encoding));
-                t->last_roll = t->dice_specs;
-            } else {
-                t->last_roll->next = malloc(sizeof(struct roll_encoding));
-                t->last_roll = t->last_roll->next;
-            }
-            dice_init(t->last_roll);
+            append_roll(t);
             t->last_roll->nsides = 1;
             t->last_roll->ndice = *tmp;
             t->ndice += *tmp;
             // First number done, now set up for whatever follows.
             *s = check_number_of_dice;
-            t->last_roll->next = malloc(sizeof(struct roll_encoding));
-            t->last_roll = t->last_roll->next;
-            dice_init(t->last_roll);
+            append_roll(t);
             t->last_roll->dir = tok->op == '+' ? pos : neg;
             break;
         case check_dice_operator: // Deal with cases like 2d4+1+3d6. The middle "roll" needs its nsides set to 1. This only happens if memory has already been allocated for the middle.
             t->last_roll->nsides = 1;
             *s = check_number_of_dice;
-            t->last_roll->next = malloc(sizeof(struct roll_encoding));
-            t->last_roll = t->last_roll->next;
-            dice_init(t->last_roll);
+            append_roll(t);
             t->last_roll->dir = tok->op == '+' ? pos : neg;
             t->last_roll->nsides = 1;
             break;
@@ -523,14 +414,7 @@ void process_keep_operator(struct token *tok, struct parse_tree *t, state_t *s,
 void process_threshold_operator(struct token *tok, struct parse_tree *t, state_t *s, long* tmp) {
     switch(*s) {
         case decide_reps_or_rolls: 
-            if(t->last_roll == NULL) {
-                t->dice_specs = malloc(sizeof(struct roll_encoding));
-                t->last_roll = t->dice_specs;
-            } else {
-                t->last_roll->next = malloc(sizeof(struct roll_encoding));
-                t->last_roll = t->last_roll->next;
-            }
-            dice_init(t->last_roll);
+            append_roll(t);
             t->last_roll->nsides = 1;
             t->last_roll->ndice = *tmp;
             t->ndice += *tmp;
@@ -563,6 +447,33 @@ void process_command(struct token *tok, struct parse_tree *t, state_t *s, long*
                     t->suppress = true;
                     clear_screen();
                     break;
+                case exact:
+                    if(t->exact || t->aggregate) {
+                        printf("Commands may not follow other expressions.\n");
+                        *s = error;
+                    } else {
+                        t->exact = true;
+                        *s = start;
+                    }
+                    break;
+                case aggregate:
+                    if(t->exact || t->aggregate) {
+                        printf("Commands may not follow other expressions.\n");
+                        *s = error;
+                    } else {
+                        t->aggregate = true;
+                        *s = start;
+                    }
+                    break;
+                case explain: // May come before exact or aggregate, to explain them.
+                    if(t->exact || t->aggregate || t->explain) {
+                        printf("Commands may not follow other expressions.\n");
+                        *s = error;
+                    } else {
+                        t->explain = true;
+                        *s = start;
+                    }
+                    break;
                 default:
                     printf("Received invalid command.\n");
                     *s = error;
@@ -579,14 +490,7 @@ void process_statement_delimiter(struct token *tok, struct parse_tree *t, state_
         case start: case check_modifiers_or_more_rolls: case check_more_rolls: case check_end:
             break;
         case decide_reps_or_rolls:
-            if(t->last_roll == NULL) {
-                t->dice_specs = malloc(sizeof(struct roll_encoding));
-                t->last_roll = t->dice_specs;
-            } else {
-                t->last_roll->next = malloc(sizeof(struct roll_encoding));
-                t->last_roll = t->last_roll->next;
-            }
-            dice_init(t->last_roll);
+            append_roll(t);
             t->last_roll->nsides = 1;
             t->last_roll->ndice = *tmp;
             t->ndice += *tmp;
@@ -607,14 +511,7 @@ void process_statement_delimiter(struct token *tok, struct parse_tree *t, state_
 void process_eol(struct token *tok, struct parse_tree *t, state_t *s, long* tmp) {
     switch(*s) {
         case decide_reps_or_rolls:
-            if(t->last_roll == NULL) {
-                t->dice_specs = malloc(sizeof(struct roll_encoding));
-                t->last_roll = t->dice_specs;
-            } else {
-                t->last_roll->next = malloc(sizeof(struct roll_encoding));
-                t->last_roll = t->last_roll->next;
-            }
-            dice_init(t->last_roll);
+            append_roll(t);
             t->last_roll->nsides = 1;
             t->last_roll->ndice = *tmp;
             t->ndice += *tmp;
@@ -637,12 +534,18 @@ void process_default(struct token *tok, struct parse_tree *t, state_t *s, long*
 void parse_tree_initialise(struct parse_tree *t) {
     t->suppress = false;
     t->quit = false;
+    t->exact = false;
+    t->aggregate = false;
+    t->explain = false;
     t->nreps = 1;
     t->ndice = 0;
     t->use_threshold = false;
     t->threshold = 0;
     t->last_roll = NULL;
     t->dice_specs = NULL;
+    t->checked = false;
+    t->prog = NULL;
+    t->arena = NULL;
     t->next = NULL;
     t->current = t;
 }
@@ -650,39 +553,57 @@ void parse_tree_initialise(struct parse_tree *t) {
 void parse_tree_reset(struct parse_tree *t) {
     t->suppress = false;
     t->quit = false;
+    t->exact = false;
+    t->aggregate = false;
+    t->explain = false;
     t->nreps = 1;
     t->ndice = 0;
     t->use_threshold = false;
     t->threshold = 0;
     t->last_roll = NULL;
-    if(t->dice_specs != NULL) {
-        dice_reset(t->dice_specs);
-        t->dice_specs = NULL;
-    }
-    if(t->next != NULL) {
-        parse_tree_reset(t->next);
-        free(t->next);
-        t->next = NULL;
-    }
+    t->dice_specs = NULL; // The dice, later statements and program stay in the arena until it is reset.
+    t->checked = false;
+    t->prog = NULL;
+    t->next = NULL;
     t->current = t;
 }
 
+void parse_tree_free(struct parse_tree *t) {
+    arena_destroy(t->arena);
+    parse_tree_initialise(t);
+}
+
+/*
+   Move the statements parsed into t, with the arena holding them, to a tree
+   of their own, leaving t empty. The new tree lives in that arena too, so
+   destroying the arena frees all of it.
+*/
+struct parse_tree *parse_tree_detach(struct parse_tree *t) {
+    struct parse_tree *d = arena_alloc(t->arena, sizeof(struct parse_tree));
+    *d = *t;
+    d->current = d;
+    parse_tree_initialise(t);
+    return d;
+}
+
 int parse(struct parse_tree *t, const char *buf, const size_t len) {
-    int tokens_found = 0;
-    struct token toks[len];
-    int lex_err = lex(toks, &tokens_found, buf, len);
-    if(lex_err != 0) {
-        return lex_err;
+    if(t->arena == NULL) {
+        t->arena = arena_create();
     }
-
     state_t s = start;
+    arena_reset(t->arena);
     parse_tree_reset(t);
     long tmp = 0;
-    int toknum;
+    size_t pos = 0;
+    struct token tok;
     void (*process_token)(struct token *tok, struct parse_tree *t, state_t *s, long* tmp);
-    for(toknum = 0; toknum < tokens_found && !(s == finish || s == error); ++toknum) {
+    while(!(s == finish || s == error)) {
+        if(0 != lex(&tok, buf, len, &pos)) {
+            s = error;
+            break;
+        }
         bool increment_statement = false;
-        switch(toks[toknum].type) {
+        switch(tok.type) {
             case none:
                 process_token = process_none;
                 break;
@@ -720,14 +641,15 @@ int parse(struct parse_tree *t, const char *buf, const size_t len) {
             default:
                 process_token = process_default;
         }
-        process_token(toks + toknum, t->current, &s, &tmp);
+        process_token(&tok, t->current, &s, &tmp);
         if(t->current->quit) {
             t->quit = true;
             break;
         }
         if(increment_statement) {
-            t->current->next = malloc(sizeof(struct parse_tree));
+            t->current->next = arena_alloc(t->arena, sizeof(struct parse_tree));
             parse_tree_initialise(t->current->next);
+            t->current->next->arena = t->arena;
             t->current = t->current->next;
         }
     }
@@ -21,16 +21,25 @@ struct roll_encoding {
     struct roll_encoding *next;
 };
 
+struct arena;
+struct program;
+
 struct parse_tree;
 struct parse_tree {
     bool suppress; // Used to silence output, eg when clearing screen
     bool quit;
+    bool exact; // Print the outcome distribution instead of rolling
+    bool aggregate; // Print a summary of the reps instead of each one
+    bool explain; // Print how the statement would be rolled instead of rolling it
     long nreps;
     bool use_threshold;
     long threshold;
     struct roll_encoding *dice_specs;
     struct roll_encoding *last_roll; // Easily find latest entry in dice_specs list
     long ndice;
+    bool checked; // Already warned about, so a cached statement is only checked once
+    struct program *prog; // Compiled on first roll and kept with the statement
+    struct arena *arena; // Holds this line's statements, their dice and programs
     struct parse_tree *next;
     struct parse_tree *current;
 };
@@ -52,12 +61,15 @@ typedef enum token_t {
 typedef enum cmd_t {
     unknown = -1,
     quit = 0,
-    clear
+    clear,
+    exact,
+    aggregate,
+    explain
 } cmd_t;
 
 struct cmd_map {
     cmd_t cmd_code;
-    char cmd_str[8];
+    char cmd_str[16];
 };
 
 struct token {
@@ -85,10 +97,12 @@ typedef enum state_t {
 
 void clear_screen();
 void token_init(struct token *t);
-int lex(struct token *t, int *tokens_found, const char *buf, const size_t len);
+int lex(struct token *t, const char *buf, const size_t len, size_t *pos);
 void print_state_name(const state_t s);
 void print_parse_tree(const struct parse_tree *t);
 int parse(struct parse_tree *t, const char *buf, const size_t len);
 void parse_tree_initialise(struct parse_tree *t);
 void parse_tree_reset(struct parse_tree *t);
+void parse_tree_free(struct parse_tree *t);
+struct parse_tree *parse_tree_detach(struct parse_tree *t);
 #endif // __PARSE_H__
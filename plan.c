@@ -0,0 +1,480 @@
+#define _GNU_SOURCE 1
+#include <limits.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <wordexp.h>
+#ifdef _OPENMP
+#include <omp.h>
+#else
+#define omp_get_max_threads() 1
+#endif
+
+#include "plan.h"
+#include "rng.h"
+#include "roll-engine.h"
+
+#define CALIBRATION_DICE (1L << 20)
+#define CALIBRATION_FORKS 256
+#define CALIBRATION_VALUES (1L << 18)
+#define CALIBRATION_MAX_TEAMS 64 // Team sizes whose fork time CALIBRATION_FILE keeps
+/*
+   Measuring takes about as long as rolling this many dice, so a smaller
+   statement is planned on the figures below rather than waiting for it.
+*/
+#define CALIBRATION_MIN_DICE (1L << 22)
+
+// Figures for a machine not measured yet; forking is taken to be dear so that nothing is shared out on a guess that would not clearly pay.
+#define DEFAULT_DIE_NS 8
+#define DEFAULT_FORK_NS 20000
+#define DEFAULT_VALUE_NS 20
+
+#define BINOMIAL_DRAW_DICE 8 // A binomial, geometric or similar draw costs about this many die rolls
+#define COMPARE_DICE 0.25 // One comparison, as a fraction of a die roll
+
+/*
+   When a statement has few possible outcomes but will be rolled many times,
+   it is cheaper to work out its distribution once and draw each rep from
+   an alias table than to roll every die of every rep. Building the table
+   costs about one step per outcome, so there must be at least as many reps
+   as outcomes to pay for it: 10x 3d6 is cheaper rolled.
+*/
+#define ALIAS_MAX_SUPPORT (1L << 16)
+
+bool alias_table_pays_off(const struct parse_tree *t) {
+    if(t->nreps < 2) {
+        return false;
+    }
+    long dice_per_rep = 0;
+    struct roll_encoding *d;
+    for(d = t->dice_specs; d != NULL; d = d->next) {
+        if(d->ndice <= 0 || d->nsides <= 1) {
+            continue;
+        }
+        if(d->explode) {
+            return false;
+        }
+        dice_per_rep = d->ndice > LONG_MAX - dice_per_rep ? LONG_MAX : dice_per_rep + d->ndice;
+    }
+    long support = estimated_support(t, ALIAS_MAX_SUPPORT);
+    return support > 0 && dice_per_rep > 0 && t->nreps >= support;
+}
+
+/*
+   A thresholded statement only reports how many reps succeeded, and that
+   count is binomial, so if the chance of one rep succeeding can be worked
+   out exactly, one draw replaces all the reps.
+*/
+bool success_count_pays_off(const struct parse_tree *t, const struct arguments *args) {
+    return t->use_threshold && t->nreps > 1 && estimated_support(t, args->exact_budget) > 0;
+}
+
+volatile long calibration_sink; // Keeps the timed loops from being optimised away
+
+double nanoseconds_since(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return 1e9*(now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec);
+}
+
+void calibrate_fork(struct calibration *c) {
+    c->threads = omp_get_max_threads();
+    struct timespec start;
+    long sum = 0;
+    long i;
+    for(i = -1; i < CALIBRATION_FORKS; ++i) {
+        if(i == 0) { // The first loop starts the team, so leave it out.
+            clock_gettime(CLOCK_MONOTONIC, &start);
+        }
+        long j;
+        #pragma omp parallel for reduction(+:sum)
+        for(j = 0; j < c->threads; ++j) {
+            sum += j;
+        }
+    }
+    c->fork_ns = nanoseconds_since(&start)/CALIBRATION_FORKS;
+    calibration_sink = sum;
+}
+
+void calibrate(struct calibration *c) {
+    struct timespec start;
+    long sum = 0;
+    long i;
+
+    struct rng_stream r;
+    rng_stream_init(&r, 0);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(i = 0; i < CALIBRATION_DICE; ++i) {
+        sum += die_face(&r, 6);
+    }
+    c->die_ns = nanoseconds_since(&start)/CALIBRATION_DICE;
+
+    calibrate_fork(c);
+
+    struct out_buffer b;
+    out_buffer_init(&b);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(i = 0; i < CALIBRATION_VALUES; ++i) {
+        out_buffer_char(&b, ' ');
+        out_buffer_long(&b, sum + i);
+    }
+    c->value_ns = nanoseconds_since(&start)/CALIBRATION_VALUES;
+    out_buffer_free(&b);
+    calibration_sink = sum;
+}
+
+/*
+   What is known of this machine, with 0 for what is not: CALIBRATION_FILE
+   keeps the die and value times and the fork time of every team size it
+   has been measured with, of which calibration holds the current one.
+*/
+struct calibration calibration;
+int saved_teams = 0;
+int saved_threads[CALIBRATION_MAX_TEAMS];
+double saved_fork_ns[CALIBRATION_MAX_TEAMS];
+bool calibration_loaded = false;
+bool calibrated = false;
+
+// CALIBRATION_FILE with ~ expanded, or NULL; free the result.
+char *calibration_path() {
+    wordexp_t matched_paths;
+    if(0 != wordexp(CALIBRATION_FILE, &matched_paths, 0)) {
+        return NULL;
+    }
+    char *path = matched_paths.we_wordc == 1 ? strdup(matched_paths.we_wordv[0]) : NULL;
+    wordfree(&matched_paths);
+    return path;
+}
+
+void calibration_read(const char *path) {
+    FILE *ist = fopen(path, "r");
+    if(ist == NULL) {
+        return;
+    }
+    double die_ns, value_ns;
+    if(2 == fscanf(ist, " die_ns %lf value_ns %lf", &die_ns, &value_ns) && die_ns > 0 && value_ns > 0) {
+        calibration.die_ns = die_ns;
+        calibration.value_ns = value_ns;
+        int threads;
+        double fork_ns;
+        while(saved_teams < CALIBRATION_MAX_TEAMS && 2 == fscanf(ist, " fork_ns %d %lf", &threads, &fork_ns)) {
+            if(threads > 0 && fork_ns > 0) {
+                saved_threads[saved_teams] = threads;
+                saved_fork_ns[saved_teams] = fork_ns;
+                ++saved_teams;
+            }
+        }
+    }
+    fclose(ist);
+}
+
+// Write to a temporary file and rename it over the old one, so another dice never reads half a file.
+void calibration_write(const char *path) {
+    size_t tmp_len = strlen(path) + 32;
+    char *tmp_path = malloc(tmp_len);
+    if(!tmp_path) {
+        fprintf(stderr, "Error allocating memory.\n");
+        exit(1);
+    }
+    snprintf(tmp_path, tmp_len, "%s.%ld.tmp", path, (long) getpid());
+    FILE *ost = fopen(tmp_path, "w");
+    if(ost == NULL) {
+        free(tmp_path);
+        return; // Not being able to save it only means measuring again next time.
+    }
+    fprintf(ost, "die_ns %.6g\nvalue_ns %.6g\n", calibration.die_ns, calibration.value_ns);
+    int i;
+    for(i = 0; i < saved_teams; ++i) {
+        fprintf(ost, "fork_ns %d %.6g\n", saved_threads[i], saved_fork_ns[i]);
+    }
+    if(fclose(ost) != 0 || rename(tmp_path, path) != 0) {
+        remove(tmp_path);
+    }
+    free(tmp_path);
+}
+
+void calibration_load() {
+    if(calibration_loaded) {
+        return;
+    }
+    calibration_loaded = true;
+    char *path = calibration_path();
+    if(path != NULL) {
+        calibration_read(path);
+        free(path);
+    }
+    calibration.threads = omp_get_max_threads();
+    int i;
+    for(i = 0; i < saved_teams; ++i) {
+        if(saved_threads[i] == calibration.threads) {
+            calibration.fork_ns = saved_fork_ns[i];
+        }
+    }
+    calibrated = calibration.die_ns > 0 && calibration.fork_ns > 0;
+}
+
+/*
+   The machine's calibration: from CALIBRATION_FILE, with whatever it lacks
+   for the current number of threads (or everything, if force is set)
+   measured now, which takes a few milliseconds, and saved for next time.
+*/
+const struct calibration *calibration_get(bool force) {
+    calibration_load();
+    if(calibrated && !force) {
+        return &calibration;
+    }
+    if(force || calibration.die_ns <= 0) {
+        calibrate(&calibration);
+    } else {
+        calibrate_fork(&calibration);
+    }
+    int i;
+    for(i = 0; i < saved_teams && saved_threads[i] != calibration.threads; ++i) {}
+    if(i == CALIBRATION_MAX_TEAMS) {
+        i = 0; // Full, so give up the first team size saved.
+    } else if(i == saved_teams) {
+        ++saved_teams;
+    }
+    saved_threads[i] = calibration.threads;
+    saved_fork_ns[i] = calibration.fork_ns;
+    char *path = calibration_path();
+    if(path != NULL) {
+        calibration_write(path);
+        free(path);
+    }
+    calibrated = true;
+    return &calibration;
+}
+
+// The calibration as far as it is known without measuring, with the defaults for the rest.
+const struct calibration *calibration_estimate() {
+    static struct calibration estimate;
+    calibration_load();
+    estimate = calibration;
+    estimate.die_ns = estimate.die_ns > 0 ? estimate.die_ns : DEFAULT_DIE_NS;
+    estimate.fork_ns = estimate.fork_ns > 0 ? estimate.fork_ns : DEFAULT_FORK_NS;
+    estimate.value_ns = estimate.value_ns > 0 ? estimate.value_ns : DEFAULT_VALUE_NS;
+    return &estimate;
+}
+
+/*
+   Nanoseconds one rep spends on the terms of prog, split into what a team
+   of threads could share out (the dice of big pools) and what it could not.
+*/
+void program_cost(const struct program *prog, double die, double *unshared, double *shared, long *nshared) {
+    *unshared = 0;
+    *shared = 0;
+    *nshared = 0;
+    long i;
+    for(i = 0; i < prog->nterms; ++i) {
+        double ndice = prog->ndice[i];
+        double nsides = prog->nsides[i];
+        double roll = prog->flags[i] & TERM_EXPLODE ? 2*die : die;
+        switch(prog->op[i]) {
+            case OP_SINGLE_DIE:
+                *unshared += roll;
+                break;
+            case OP_FACE_COUNTS:
+                *unshared += nsides*BINOMIAL_DRAW_DICE*die;
+                break;
+            case OP_EXPLODING_AGGREGATE:
+                *unshared += BINOMIAL_DRAW_DICE*die;
+                *unshared += face_counts_pay_off(prog->ndice[i], prog->nsides[i] - 1) ? (nsides - 1)*BINOMIAL_DRAW_DICE*die : ndice*die;
+                break;
+            case OP_KEEP_HISTOGRAM:
+                *shared += ndice*die;
+                *unshared += nsides*COMPARE_DICE*die;
+                ++*nshared;
+                break;
+            case OP_STREAMING_KEEP:
+                {
+                    double kept = ndice - prog->discard[i];
+                    double heap = kept < prog->discard[i] ? kept : prog->discard[i];
+                    *shared += ndice*(roll + log2(heap + 1)*COMPARE_DICE*die);
+                    ++*nshared;
+                }
+                break;
+            default:
+                *shared += ndice*roll;
+                if(prog->discard[i] > 0) {
+                    *unshared += 2*ndice*COMPARE_DICE*die;
+                }
+                ++*nshared;
+        }
+    }
+}
+
+/*
+   Nanoseconds for nreps reps of which each takes rep ns and can only be
+   shared out by rep. A summary starts a team for every block of reps;
+   other statements share one team with the rest of their line.
+*/
+double rep_parallel_cost(long nreps, int threads, double rep, double fork, bool summary) {
+    long regions = summary ? nreps/REP_BLOCK_SIZE + (nreps%REP_BLOCK_SIZE != 0) : 1;
+    long per_thread = nreps/threads + (nreps%threads != 0);
+    return regions*fork + per_thread*rep;
+}
+
+void choose_cheapest(struct plan *plan, plan_kind first, plan_kind last) {
+    plan_kind k;
+    plan->kind = first;
+    for(k = first; k <= last; ++k) {
+        if(plan->cost[k] >= 0 && (plan->cost[plan->kind] < 0 || plan->cost[k] < plan->cost[plan->kind])) {
+            plan->kind = k;
+        }
+    }
+}
+
+/*
+   Cost out the ways of rolling nreps reps of t and pick the cheapest. The
+   threading strategies all produce the same results, so they are chosen on
+   the measured costs of this machine. Drawing from a known distribution
+   produces different (equally random) results, so whether to do that is
+   decided by counting die rolls against outcomes, the same on every
+   machine, and a given seed gives the same results everywhere; in that case
+   the distribution is left in x.
+*/
+void plan_statement(const struct parse_tree *t, const struct program *prog, long nreps, const struct arguments *args, struct distribution *x, struct plan *plan) {
+    plan_kind k;
+    for(k = 0; k < PLAN_KINDS; ++k) {
+        plan->cost[k] = -1;
+    }
+    plan->kind = PLAN_SERIAL;
+    plan->rep_threads = 1;
+    plan->die_threads = 1;
+    if(t->exact) {
+        long support = estimated_support(t, DIST_MAX_SUPPORT);
+        plan->kind = PLAN_EXACT;
+        plan->cost[PLAN_EXACT] = support > 0 ? 1e-9*support*calibration_estimate()->die_ns : -1;
+        return;
+    }
+    if(t->dice_specs == NULL || nreps <= 0) {
+        plan->cost[PLAN_SERIAL] = 0;
+        return;
+    }
+    int threads = omp_get_max_threads();
+    long dice = 0;
+    long i;
+    for(i = 0; i < prog->nterms; ++i) {
+        dice = prog->ndice[i] > LONG_MAX - dice ? LONG_MAX : dice + prog->ndice[i];
+    }
+    // With one thread, or little to roll, the choice is not worth measuring the machine for.
+    bool measure = threads > 1 && dice > 0 && nreps >= CALIBRATION_MIN_DICE/dice;
+    const struct calibration *c = measure ? calibration_get(false) : calibration_estimate();
+    double die = c->die_ns;
+    double fork = c->fork_ns;
+    bool summary = t->aggregate || args->shard_count > 0;
+    double value = t->use_threshold || summary ? 0 : c->value_ns;
+    double unshared, shared;
+    long nshared;
+    program_cost(prog, die, &unshared, &shared, &nshared);
+    double rep = unshared + shared + value;
+
+    plan->cost[PLAN_SERIAL] = nreps*rep;
+    if(threads > 1 && nreps > 1) {
+        plan->cost[PLAN_REP_PARALLEL] = rep_parallel_cost(nreps, threads, rep, fork, summary);
+    }
+    if(threads > 1 && nshared > 0) {
+        plan->cost[PLAN_DIE_PARALLEL] = nreps*(unshared + value + nshared*fork + shared/threads);
+    }
+    int outer = nreps < threads ? nreps : threads;
+    if(nshared > 0 && outer > 1 && threads/outer > 1) {
+        plan->cost[PLAN_NESTED] = rep_parallel_cost(nreps, outer, unshared + value + nshared*fork + shared/(threads/outer), fork, summary);
+    }
+    choose_cheapest(plan, PLAN_SERIAL, PLAN_NESTED);
+    switch(plan->kind) {
+        case PLAN_REP_PARALLEL:
+            plan->rep_threads = threads;
+            break;
+        case PLAN_DIE_PARALLEL:
+            plan->die_threads = threads;
+            break;
+        case PLAN_NESTED:
+            plan->rep_threads = outer;
+            plan->die_threads = threads/outer;
+            break;
+        default: {}
+    }
+
+    if(summary) {
+        if(alias_table_pays_off(t) && 0 == expression_distribution(t, x)) {
+            long blocks = nreps/MULTINOMIAL_BLOCK_SIZE + 1;
+            plan->cost[PLAN_MULTINOMIAL] = (x->len + blocks*x->len*BINOMIAL_DRAW_DICE)*die;
+            plan->kind = PLAN_MULTINOMIAL;
+            plan->rep_threads = 1;
+            plan->die_threads = 1;
+        }
+    } else {
+        bool count_successes = success_count_pays_off(t, args);
+        if((count_successes || alias_table_pays_off(t)) && 0 == expression_distribution(t, x)) {
+            plan->rep_threads = 1;
+            plan->die_threads = 1;
+            if(count_successes) {
+                plan->cost[PLAN_SUCCESS_COUNT] = (x->len + BINOMIAL_DRAW_DICE)*die;
+                plan->kind = PLAN_SUCCESS_COUNT;
+            } else {
+                double draw = 2*die + value;
+                double serial = nreps*draw;
+                double parallel = threads > 1 ? rep_parallel_cost(nreps, threads, draw, fork, false) : -1;
+                if(parallel >= 0 && parallel < serial) {
+                    plan->rep_threads = threads;
+                    serial = parallel;
+                }
+                plan->cost[PLAN_ALIAS] = 4*x->len*die + serial;
+                plan->kind = PLAN_ALIAS;
+            }
+        }
+    }
+    for(k = 0; k < PLAN_KINDS; ++k) {
+        if(plan->cost[k] >= 0) {
+            plan->cost[k] *= 1e-9;
+        }
+    }
+}
+
+const char *plan_name(plan_kind kind) {
+    switch(kind) {
+        case PLAN_SERIAL:
+            return "serial";
+        case PLAN_REP_PARALLEL:
+            return "rep-parallel";
+        case PLAN_DIE_PARALLEL:
+            return "die-parallel";
+        case PLAN_NESTED:
+            return "nested";
+        case PLAN_ALIAS:
+            return "alias";
+        case PLAN_SUCCESS_COUNT:
+            return "success-count";
+        case PLAN_MULTINOMIAL:
+            return "multinomial";
+        case PLAN_EXACT:
+            return "exact";
+        default:
+            return "unknown";
+    }
+}
+
+/*
+   The chosen plan, its threads (sharing out reps, then dice), and the
+   estimated seconds for it and for every strategy that applies.
+*/
+void print_plan(const struct plan *plan) {
+    char line[128];
+    int len = snprintf(line, sizeof(line), "plan %s\nthreads %d %d\n", plan_name(plan->kind), plan->rep_threads, plan->die_threads);
+    output_bytes(line, len);
+    if(plan->cost[plan->kind] >= 0) {
+        len = snprintf(line, sizeof(line), "estimate %.3g\n", plan->cost[plan->kind]);
+        output_bytes(line, len);
+    }
+    plan_kind k;
+    for(k = 0; k < PLAN_KINDS; ++k) {
+        if(plan->cost[k] >= 0) {
+            len = snprintf(line, sizeof(line), "%s %.3g\n", plan_name(k), plan->cost[k]);
+            output_bytes(line, len);
+        }
+    }
+}
@@ -0,0 +1,47 @@
+#ifndef __PLAN_H__
+#define __PLAN_H__
+#include <stdbool.h>
+#include "dist.h"
+#include "io.h"
+#include "parse.h"
+#include "program.h"
+
+#define CALIBRATION_FILE "~/.dice_calibration"
+
+// Ways of carrying out a statement, in the order they are preferred on equal cost.
+typedef enum plan_kind {
+    PLAN_SERIAL = 0, // One rep after another, one die after another
+    PLAN_REP_PARALLEL, // Threads share out the reps
+    PLAN_DIE_PARALLEL, // Reps in turn, threads share out each term's dice
+    PLAN_NESTED, // Threads share out the reps, and teams within them the dice
+    PLAN_ALIAS, // Every rep drawn from an alias table of the statement's distribution
+    PLAN_SUCCESS_COUNT, // The number of successes drawn in one step
+    PLAN_MULTINOMIAL, // The histogram of all the reps drawn in one step
+    PLAN_EXACT, // The distribution printed instead of rolled
+    PLAN_KINDS
+} plan_kind;
+
+// How long the basic steps take on this machine, measured once and saved in CALIBRATION_FILE.
+struct calibration {
+    int threads; // Team size the fork time is for
+    double die_ns; // Rolling one die
+    double fork_ns; // Starting and joining a parallel loop
+    double value_ns; // Formatting one result as text
+};
+
+struct plan {
+    plan_kind kind;
+    int rep_threads;
+    int die_threads;
+    double cost[PLAN_KINDS]; // Estimated seconds, or < 0 where the strategy does not apply
+};
+
+bool alias_table_pays_off(const struct parse_tree *t);
+bool success_count_pays_off(const struct parse_tree *t, const struct arguments *args);
+void calibrate(struct calibration *c);
+const struct calibration *calibration_get(bool force);
+const struct calibration *calibration_estimate();
+void plan_statement(const struct parse_tree *t, const struct program *prog, long nreps, const struct arguments *args, struct distribution *x, struct plan *plan);
+const char *plan_name(plan_kind kind);
+void print_plan(const struct plan *plan);
+#endif // __PLAN_H__
@@ -0,0 +1,101 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "arena.h"
+#include "program.h"
+
+/*
+   For big pools of non-exploding dice, only how many dice show each face
+   matters, so draw those counts directly: O(nsides) time and memory
+   instead of O(ndice).
+*/
+bool face_counts_pay_off(long ndice, long nsides) {
+    return nsides <= FACE_COUNT_MAX_SIDES && ndice/FACE_COUNT_MIN_DICE_PER_SIDE >= nsides;
+}
+
+/*
+   When every die of an exploding term counts towards the total, the total
+   number of explosions over the term is negative binomial, and what's left
+   is ndice plain rolls of a die without its top face.
+*/
+#define EXPLODE_AGGREGATE_MIN_DICE 32
+
+/*
+   Keeping the best of a pool of non-exploding dice only needs to know how
+   many dice came up on each face, so tally them rather than sorting them,
+   as long as there are few enough faces (or more dice than faces).
+*/
+#define KEEP_HISTOGRAM_MAX_SIDES 256
+
+/*
+   Big keep pools only need whichever of the kept or the discarded dice are
+   fewer, so stream the rolls through a bounded heap of that many instead of
+   holding all of them.
+*/
+#define STREAMING_KEEP_MIN_DICE (1L << 16)
+
+term_op choose_term_op(const struct roll_encoding *d) {
+    if(d->ndice == 1 && d->discard <= 0) {
+        return OP_SINGLE_DIE;
+    }
+    if(!d->explode && face_counts_pay_off(d->ndice, d->nsides)) {
+        return OP_FACE_COUNTS;
+    }
+    if(d->explode && d->discard == 0 && d->ndice >= EXPLODE_AGGREGATE_MIN_DICE) {
+        return OP_EXPLODING_AGGREGATE;
+    }
+    if(d->discard > 0 && !d->explode && (d->nsides <= KEEP_HISTOGRAM_MAX_SIDES || d->nsides <= d->ndice)) {
+        return OP_KEEP_HISTOGRAM;
+    }
+    if(d->discard > 0 && d->ndice >= STREAMING_KEEP_MIN_DICE) {
+        return OP_STREAMING_KEEP;
+    }
+    return OP_ROLLS;
+}
+
+void program_init(struct program *prog) {
+    prog->nterms = 0;
+    prog->constant = 0;
+    prog->op = NULL;
+    prog->dir = NULL;
+    prog->flags = NULL;
+    prog->ndice = NULL;
+    prog->nsides = NULL;
+    prog->discard = NULL;
+    prog->term = NULL;
+}
+
+// Compile t into prog, taking the arrays from arena a so they go when the statement does.
+void program_compile(struct program *prog, const struct parse_tree *t, struct arena *a) {
+    program_init(prog);
+    long n = 0;
+    const struct roll_encoding *d;
+    for(d = t->dice_specs; d != NULL; d = d->next) {
+        ++n;
+    }
+    prog->op = arena_alloc(a, n);
+    prog->dir = arena_alloc(a, n);
+    prog->flags = arena_alloc(a, n);
+    prog->ndice = arena_alloc(a, sizeof(long)*n);
+    prog->nsides = arena_alloc(a, sizeof(long)*n);
+    prog->discard = arena_alloc(a, sizeof(long)*n);
+    prog->term = arena_alloc(a, sizeof(long)*n);
+    long term = 0;
+    for(d = t->dice_specs; d != NULL; d = d->next, ++term) {
+        if(d->ndice <= 0 || d->nsides <= 0) {
+            continue;
+        }
+        if(d->nsides == 1) {
+            prog->constant += d->dir*d->ndice;
+            continue;
+        }
+        long i = prog->nterms++;
+        prog->op[i] = choose_term_op(d);
+        prog->dir[i] = d->dir;
+        prog->flags[i] = d->explode ? TERM_EXPLODE : 0;
+        prog->ndice[i] = d->ndice;
+        prog->nsides[i] = d->nsides;
+        prog->discard[i] = d->discard > 0 ? d->discard : 0;
+        prog->term[i] = term;
+    }
+}
@@ -0,0 +1,42 @@
+#ifndef __PROGRAM_H__
+#define __PROGRAM_H__
+#include <stdbool.h>
+#include "parse.h"
+
+// How a term is rolled, decided once when the statement is compiled.
+typedef enum term_op {
+    OP_SINGLE_DIE = 0, // One die, no keep
+    OP_FACE_COUNTS, // Big pool of plain dice: draw how many show each face
+    OP_EXPLODING_AGGREGATE, // Big pool of exploding dice, all kept: negative binomial explosions
+    OP_KEEP_HISTOGRAM, // Keep from a pool with few faces: tally the faces
+    OP_STREAMING_KEEP, // Keep from a huge pool: bounded heap of the smaller side
+    OP_ROLLS // Anything else: roll every die
+} term_op;
+
+#define TERM_EXPLODE 1
+
+/*
+   A statement lowered for the roll engine: its random terms laid out as
+   parallel arrays, with the way each is rolled already chosen and the
+   non-random parts (eg the "+1" in "d4+1") folded into constant, so a rep
+   is one pass over a few flat arrays.
+*/
+struct program {
+    long nterms;
+    long constant;
+    unsigned char *op;
+    signed char *dir; // +1 or -1
+    unsigned char *flags;
+    long *ndice;
+    long *nsides;
+    long *discard;
+    long *term; // Position in the statement, which names the term's random stream
+};
+
+#define FACE_COUNT_MIN_DICE_PER_SIDE 4
+#define FACE_COUNT_MAX_SIDES (1L << 20)
+
+bool face_counts_pay_off(long ndice, long nsides);
+void program_init(struct program *prog);
+void program_compile(struct program *prog, const struct parse_tree *t, struct arena *a);
+#endif // __PROGRAM_H__
@@ -0,0 +1,54 @@
+#include <stdint.h>
+
+#include "rng.h"
+
+uint32_t rng_key[2] = { 0, 0 };
+
+void rng_seed(uint64_t seed) {
+    rng_key[0] = (uint32_t)seed;
+    rng_key[1] = (uint32_t)(seed >> 32);
+}
+
+void philox4x32(uint32_t ctr[4], const uint32_t key[2]) {
+    uint32_t k0 = key[0];
+    uint32_t k1 = key[1];
+    int round;
+    for(round = 0; round < PHILOX_ROUNDS; ++round) {
+        PHILOX_ROUND(ctr[0], ctr[1], ctr[2], ctr[3], k0, k1);
+    }
+}
+
+// Derive the id of the index'th child stream of parent, eg the stream for
+// one die within a term, or one rep within a statement.
+uint64_t rng_stream_id(uint64_t parent, uint64_t index) {
+    return mix64(parent ^ mix64(index + RNG_INDEX_OFFSET));
+}
+
+void rng_stream_init(struct rng_stream *r, uint64_t id) {
+    r->id = id;
+    r->block = 0;
+    r->avail = 0;
+}
+
+uint32_t rng_next32(struct rng_stream *r) {
+    if(r->avail == 0) {
+        r->buf[0] = (uint32_t)r->block;
+        r->buf[1] = (uint32_t)(r->block >> 32);
+        r->buf[2] = (uint32_t)r->id;
+        r->buf[3] = (uint32_t)(r->id >> 32);
+        philox4x32(r->buf, rng_key);
+        ++r->block;
+        r->avail = 4;
+    }
+    return r->buf[--r->avail];
+}
+
+uint64_t rng_next64(struct rng_stream *r) {
+    uint64_t hi = rng_next32(r);
+    return (hi << 32) | rng_next32(r);
+}
+
+// Uniform on [0, 1) with 53 bits of precision.
+double rng_unif(struct rng_stream *r) {
+    return (rng_next64(r) >> 11) * (1.0/9007199254740992.0);
+}
@@ -0,0 +1,58 @@
+#ifndef __RNG_H__
+#define __RNG_H__
+#include <stdint.h>
+
+/*
+   Counter-based random number streams (Philox4x32-10).
+   Every stream is identified by a 64-bit id and is a pure function of
+   (seed, id, position), so streams can be handed out to threads in any
+   order without changing the numbers they produce.
+*/
+struct rng_stream {
+    uint64_t id;
+    uint64_t block;
+    uint32_t buf[4];
+    unsigned int avail;
+};
+
+// Ref: Salmon et al, "Parallel random numbers: as easy as 1, 2, 3" (SC11).
+#define PHILOX_M0 0xD2511F53u
+#define PHILOX_M1 0xCD9E8D57u
+#define PHILOX_W0 0x9E3779B9u
+#define PHILOX_W1 0xBB67AE85u
+#define PHILOX_ROUNDS 10
+
+/*
+   One Philox round on the counter c0..c3 with key k0, k1, which it bumps
+   for the next round. A macro, so loops over many counters at once (see
+   batch.c) can be vectorised.
+*/
+#define PHILOX_ROUND(c0, c1, c2, c3, k0, k1) do { \
+        uint64_t p0_ = (uint64_t)PHILOX_M0 * (c0); \
+        uint64_t p1_ = (uint64_t)PHILOX_M1 * (c2); \
+        (c0) = (uint32_t)(p1_ >> 32) ^ (c1) ^ (k0); \
+        (c2) = (uint32_t)(p0_ >> 32) ^ (c3) ^ (k1); \
+        (c1) = (uint32_t)p1_; \
+        (c3) = (uint32_t)p0_; \
+        (k0) += PHILOX_W0; \
+        (k1) += PHILOX_W1; \
+    } while(0)
+
+// Finaliser from splitmix64; used to spread child indices over the id space.
+static inline uint64_t mix64(uint64_t z) {
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return z ^ (z >> 31);
+}
+
+#define RNG_INDEX_OFFSET 0x9E3779B97F4A7C15ull // Added to a child index before mixing it
+
+extern uint32_t rng_key[2];
+
+void rng_seed(uint64_t seed);
+uint64_t rng_stream_id(uint64_t parent, uint64_t index);
+void rng_stream_init(struct rng_stream *r, uint64_t id);
+uint32_t rng_next32(struct rng_stream *r);
+uint64_t rng_next64(struct rng_stream *r);
+double rng_unif(struct rng_stream *r);
+#endif // __RNG_H__
@@ -9,54 +9,72 @@
 #include <math.h>
 #include <signal.h>
 #include <limits.h>
+#include <stdint.h>
 
 #include <readline/readline.h>
 #include <readline/history.h>
+#ifdef _OPENMP
 #include <omp.h>
+#else
+#define omp_get_max_threads() 1
+#endif
 
 #include "parse.h"
 #include "io.h"
+#include "plan.h"
+#include "program.h"
 #include "roll-engine.h"
+#include "aggregate.h"
+#include "alias.h"
+#include "arena.h"
+#include "batch.h"
+#include "checkpoint.h"
+#include "dist.h"
+#include "rng.h"
+#include "sample.h"
 #include "util.h"
 
-bool break_print_loop = false;
+volatile bool break_print_loop = false;
+uint64_t statement_sequence = 0; // Gives each rolled statement its own family of random streams.
+long statements_rolled = 0; // Every statement so far, including exact ones, so a checkpoint can find its place.
 
 void sigint_handler(int sig) {
     break_print_loop = true;
 }
 
-void print_dice_specs(const struct roll_encoding *d) {
-    switch(d->dir) {
-        case pos:
-            fprintf(stderr, "+");
-            break;
-        case neg:
-            fprintf(stderr, "-");
-            break;
-        default:
-            fprintf(stderr, "?");
-    }
-    fprintf(stderr, "%ldd%ld%s", d->ndice, d->nsides, d->explode ? "!" : "");
-    if(d->next != NULL) {
-        print_dice_specs(d->next);
-    }
-}
+/*
+   The plain SIGINT handler stays, so it is only installed once rather than
+   costing a system call for every roll. With checkpoints, Ctrl-C and
+   SIGTERM stop at the next checkpoint instead of abandoning the statement;
+   those handlers are taken down again after every statement.
+*/
+bool sigint_handler_installed = false;
 
-void free_dice(struct roll_encoding *);
-void free_dice(struct roll_encoding *d) {
-    if(d->next != NULL) {
-        free_dice(d->next);
+void install_stop_handlers() {
+    if(!sigint_handler_installed) {
+        signal(SIGINT, sigint_handler);
+        sigint_handler_installed = true;
+    }
+    if(checkpoint_enabled()) {
+        checkpoint_catch_signals();
     }
-    dice_init(d);
-    free(d);
+    break_print_loop = false;
 }
 
-void dice_reset(struct roll_encoding *d) {
-    if(d->next != NULL) {
-        dice_reset(d->next);
+void print_dice_specs(const struct roll_encoding *d) {
+    for(; d != NULL; d = d->next) {
+        switch(d->dir) {
+            case pos:
+                fprintf(stderr, "+");
+                break;
+            case neg:
+                fprintf(stderr, "-");
+                break;
+            default:
+                fprintf(stderr, "?");
+        }
+        fprintf(stderr, "%ldd%ld%s", d->ndice, d->nsides, d->explode ? "!" : "");
     }
-    dice_init(d);
-    free(d);
 }
 
 void dice_init(struct roll_encoding *d) {
@@ -69,77 +87,322 @@ void dice_init(struct roll_encoding *d) {
     d->next = NULL;
 }
 
-double runif() {
-    return (double)random()/RAND_MAX;
+/*
+   Uniform integer on [0, range) by multiply-shift with rejection, so no
+   floating point and no modulo bias.
+   Ref: Lemire, "Fast Random Integer Generation in an Interval", ACM TOMACS 2019.
+*/
+uint64_t uniform_below(struct rng_stream *r, uint64_t range) {
+    if((range & (range - 1)) == 0) { // d2, d4, d8, ...: just mask off the bits we need.
+        if(range <= ((uint64_t)1 << 32)) {
+            return rng_next32(r) & (range - 1);
+        }
+        return rng_next64(r) & (range - 1);
+    }
+    if(range <= UINT32_MAX) {
+        uint32_t range32 = (uint32_t)range;
+        uint64_t m = (uint64_t)rng_next32(r) * range32;
+        uint32_t low = (uint32_t)m;
+        if(low < range32) {
+            uint32_t reject_below = -range32 % range32;
+            while(low < reject_below) {
+                m = (uint64_t)rng_next32(r) * range32;
+                low = (uint32_t)m;
+            }
+        }
+        return m >> 32;
+    }
+    unsigned __int128 m = (unsigned __int128)rng_next64(r) * range;
+    uint64_t low = (uint64_t)m;
+    if(low < range) {
+        uint64_t reject_below = -range % range;
+        while(low < reject_below) {
+            m = (unsigned __int128)rng_next64(r) * range;
+            low = (uint64_t)m;
+        }
+    }
+    return (uint64_t)(m >> 64);
 }
 
-long single_dice_outcome(struct roll_encoding *d) {
-    if(d->nsides < 1) {
-        fprintf(stderr, "Invalid number of sides: %ld\n", d->nsides);
+// Face shown by a single fair die, from 1 to nsides inclusive.
+long die_face(struct rng_stream *r, long nsides) {
+    return 1 + (long)uniform_below(r, (uint64_t)nsides);
+}
+
+/*
+   An exploding die rerolls on its top face, so the number of explosions is
+   geometric with parameter 1/nsides and the die always stops on one of the
+   other faces. Draw both in one go rather than one reroll at a time.
+*/
+long single_dice_outcome(long nsides, bool explode, struct rng_stream *r) {
+    if(nsides < 1) {
+        fprintf(stderr, "Invalid number of sides: %ld\n", nsides);
         return LONG_MIN;
-    } else if(d->nsides == 1) {
+    } else if(nsides == 1) {
         return 1;
+    } else if(explode) {
+        long explosions = geometric_sample(r, 1.0/nsides);
+        return explosions*nsides + die_face(r, nsides - 1);
     } else {
-        long roll = ceil(runif()*d->nsides);
-        long sum = roll;
-        if(d->explode) {
-            while(roll == d->nsides) {
-                roll = ceil(runif()*d->nsides);
-                sum += roll;
-            }
+        return die_face(r, nsides);
+    }
+}
+
+// Total of the dice tallied in counts, by face, after discarding the lowest discard of them.
+long face_counts_kept_total(const long *counts, long nsides, long discard) {
+    long sum = 0;
+    long remove = discard;
+    long face;
+    for(face = 0; face < nsides; ++face) {
+        long kept = counts[face];
+        if(remove > 0) {
+            long dropped = remove < kept ? remove : kept;
+            kept -= dropped;
+            remove -= dropped;
         }
-        return sum;
+        sum += kept*(face + 1);
     }
+    return sum;
 }
 
-long parallelised_total_dice_outcome(struct roll_encoding *d) {
-    if(d->nsides == 1) { // Optimise for non-random parts eg the "+1" in "d4+1".
-        return d->ndice;
+// Total of ndice fair dice after discarding the lowest discard of them, drawn by face counts.
+long face_count_total(struct rng_stream *r, long ndice, long nsides, long discard) {
+    long *counts = malloc(sizeof(long)*nsides);
+    if(!counts) {
+        fprintf(stderr, "Error allocating memory.\n");
+        exit(1);
     }
-    long sum = 0;
-    bool keep_going = true;
-    long *rolls = malloc(sizeof(long)*d->ndice);
-    long roll_num;
-    #pragma omp parallel for private(roll_num) shared(keep_going, rolls)
-    for(roll_num = 0; roll_num < d->ndice && keep_going; ++roll_num) {
-        if(keep_going) {
-            rolls[roll_num] = single_dice_outcome(d);
-            sum += rolls[roll_num];
+    uniform_multinomial_sample(r, ndice, nsides, counts);
+    long sum = face_counts_kept_total(counts, nsides, discard);
+    free(counts);
+    return sum;
+}
+
+// a + b for a, b >= 0, pinned at LONG_MAX rather than overflowing.
+long saturating_add(long a, long b) {
+    return b > LONG_MAX - a ? LONG_MAX : a + b;
+}
+
+/*
+   A total too big for a long is pinned at LONG_MAX, which
+   check_roll_sanity has warned of, rather than left to overflow.
+*/
+long exploding_total(uint64_t term_id, long ndice, long nsides) {
+    struct rng_stream r;
+    rng_stream_init(&r, term_id);
+    long explosions = negative_binomial_sample(&r, ndice, 1.0/nsides);
+    long sum = explosions > LONG_MAX/nsides ? LONG_MAX : explosions*nsides;
+    long last_sides = nsides - 1;
+    if(last_sides == 1) {
+        sum = saturating_add(sum, ndice);
+    } else if(face_counts_pay_off(ndice, last_sides)) {
+        sum = saturating_add(sum, face_count_total(&r, ndice, last_sides, 0));
+    } else {
+        long roll_num;
+        for(roll_num = 0; roll_num < ndice && !break_print_loop; ++roll_num) {
+            sum = saturating_add(sum, die_face(&r, last_sides));
         }
-        if(break_print_loop) {
-            keep_going = false;
+    }
+    return sum;
+}
+
+long *alloc_counts(long n) {
+    long *counts = calloc(n, sizeof(long));
+    if(!counts) {
+        fprintf(stderr, "Error allocating memory.\n");
+        exit(1);
+    }
+    return counts;
+}
+
+// The part [*start, *end) of n units of work that falls to part index of nparts, split as evenly as possible.
+void split_range(long n, long nparts, long index, long *start, long *end) {
+    long share = n/nparts;
+    long extra = n%nparts;
+    *start = share*index + (index < extra ? index : extra);
+    *end = *start + share + (index < extra ? 1 : 0);
+}
+
+/*
+   How many tasks to split ndice dice into for threads threads. There are
+   several per thread, so a thread that finishes early, eg because its dice
+   exploded less, can take on tasks the others have not started.
+*/
+long die_chunks(long ndice, int threads) {
+    long chunks = threads > 1 ? (long)threads*TASKS_PER_THREAD : 1;
+    return chunks < ndice ? chunks : (ndice > 0 ? ndice : 1);
+}
+
+/*
+   Each task counts faces into an array it allocates itself, so on a NUMA
+   machine the pages are first touched, and so placed, by the thread that
+   uses them.
+*/
+long keep_histogram_total(uint64_t term_id, long ndice, long nsides, long discard, int threads) {
+    long nchunks = die_chunks(ndice, threads);
+    long **chunk_counts = malloc(sizeof(long *)*nchunks);
+    if(!chunk_counts) {
+        fprintf(stderr, "Error allocating memory.\n");
+        exit(1);
+    }
+    long chunk;
+    for(chunk = 0; chunk < nchunks; ++chunk) {
+        #pragma omp task firstprivate(chunk) if(nchunks > 1)
+        {
+            long *counts = alloc_counts(nsides);
+            long start, end;
+            split_range(ndice, nchunks, chunk, &start, &end);
+            long roll_num;
+            if(die_batch_applies(nsides)) {
+                long faces[DIE_BATCH];
+                for(roll_num = start; roll_num < end && !break_print_loop; roll_num += DIE_BATCH) {
+                    long n = end - roll_num < DIE_BATCH ? end - roll_num : DIE_BATCH;
+                    die_faces(term_id, roll_num, n, nsides, faces);
+                    long i;
+                    for(i = 0; i < n; ++i) {
+                        counts[faces[i] - 1] += 1;
+                    }
+                }
+            } else {
+                for(roll_num = start; roll_num < end && !break_print_loop; ++roll_num) {
+                    struct rng_stream r;
+                    rng_stream_init(&r, rng_stream_id(term_id, roll_num));
+                    counts[die_face(&r, nsides) - 1] += 1;
+                }
+            }
+            chunk_counts[chunk] = counts;
         }
     }
-    if(d->discard > 0) {
-        qsort_r(rolls, d->ndice, sizeof(long), integer_difference_sign, NULL);
-        long remove = 0;
-        for(roll_num = 0; roll_num < d->ndice && roll_num < d->discard; ++roll_num) {
-            remove += rolls[roll_num];
+    #pragma omp taskwait
+    long *counts = chunk_counts[0];
+    long face;
+    for(chunk = 1; chunk < nchunks; ++chunk) {
+        for(face = 0; face < nsides; ++face) {
+            counts[face] += chunk_counts[chunk][face];
         }
-        sum -= remove;
+        free(chunk_counts[chunk]);
     }
-    free(rolls);
+    long sum = face_counts_kept_total(counts, nsides, discard);
+    free(counts);
+    free(chunk_counts);
     return sum;
 }
 
-long serial_total_dice_outcome(struct roll_encoding *d) {
-    if(d->nsides == 1) { // Optimise for non-random parts eg the "+1" in "d4+1".
-        return d->ndice;
+// Each task fills its own bounded heap; they are merged at the end.
+long streaming_keep_total(uint64_t term_id, long ndice, long nsides, long discard, bool explode, int threads) {
+    long nkept = ndice - discard;
+    bool track_discarded = discard <= nkept;
+    long capacity = track_discarded ? discard : nkept;
+    long nchunks = die_chunks(ndice, threads);
+    struct bounded_heap *heaps = malloc(sizeof(struct bounded_heap)*nchunks);
+    long *sums = alloc_counts(nchunks);
+    if(!heaps) {
+        fprintf(stderr, "Error allocating memory.\n");
+        exit(1);
     }
-    long roll_num = 0;
-    long sum = 0;
-    long *rolls = malloc(sizeof(long)*d->ndice);
-    for(roll_num = 0; roll_num < d->ndice; ++roll_num) {
-        rolls[roll_num] = single_dice_outcome(d);
-        sum += rolls[roll_num];
-        if(break_print_loop) {
-            break;
+    long chunk;
+    for(chunk = 0; chunk < nchunks; ++chunk) {
+        #pragma omp task firstprivate(chunk) if(nchunks > 1)
+        {
+            struct bounded_heap *h = &heaps[chunk];
+            bounded_heap_init(h, capacity, track_discarded);
+            long start, end;
+            split_range(ndice, nchunks, chunk, &start, &end);
+            long roll_num;
+            if(!explode && die_batch_applies(nsides)) {
+                long faces[DIE_BATCH];
+                for(roll_num = start; roll_num < end && !break_print_loop; roll_num += DIE_BATCH) {
+                    long n = end - roll_num < DIE_BATCH ? end - roll_num : DIE_BATCH;
+                    sums[chunk] += die_faces(term_id, roll_num, n, nsides, faces);
+                    long i;
+                    for(i = 0; i < n; ++i) {
+                        bounded_heap_push(h, faces[i]);
+                    }
+                }
+            } else {
+                for(roll_num = start; roll_num < end && !break_print_loop; ++roll_num) {
+                    struct rng_stream r;
+                    rng_stream_init(&r, rng_stream_id(term_id, roll_num));
+                    long roll = single_dice_outcome(nsides, explode, &r);
+                    sums[chunk] += roll;
+                    bounded_heap_push(h, roll);
+                }
+            }
+        }
+    }
+    #pragma omp taskwait
+    long total = 0;
+    struct bounded_heap merged;
+    bounded_heap_init(&merged, capacity, track_discarded);
+    for(chunk = 0; chunk < nchunks; ++chunk) {
+        total += sums[chunk];
+        long i;
+        for(i = 0; i < heaps[chunk].size; ++i) {
+            bounded_heap_push(&merged, heaps[chunk].v[i]);
         }
+        bounded_heap_free(&heaps[chunk]);
+    }
+    long result = track_discarded ? total - merged.sum : merged.sum;
+    bounded_heap_free(&merged);
+    free(heaps);
+    free(sums);
+    return result;
+}
+
+/*
+   rolls is left uninitialised, so each task's share of a big array is
+   first touched, and so placed on a NUMA machine, by the thread filling it.
+*/
+long rolls_total(uint64_t term_id, long ndice, long nsides, long discard, bool explode, int threads) {
+    long *rolls = discard > 0 ? malloc(sizeof(long)*ndice) : NULL; // Only keeping needs the individual rolls.
+    if(discard > 0 && !rolls) {
+        fprintf(stderr, "Error allocating memory.\n");
+        exit(1);
     }
-    if(d->discard > 0) {
-        qsort_r(rolls, d->ndice, sizeof(long), integer_difference_sign, NULL);
+    long nchunks = die_chunks(ndice, threads);
+    long *sums = alloc_counts(nchunks);
+    long chunk;
+    for(chunk = 0; chunk < nchunks; ++chunk) {
+        #pragma omp task firstprivate(chunk) if(nchunks > 1)
+        {
+            long start, end;
+            split_range(ndice, nchunks, chunk, &start, &end);
+            long roll_num = start;
+            if(!explode && die_batch_applies(nsides)) {
+                for(; roll_num < end && !break_print_loop; roll_num += DIE_BATCH) {
+                    long n = end - roll_num < DIE_BATCH ? end - roll_num : DIE_BATCH;
+                    if(rolls) {
+                        sums[chunk] += die_faces(term_id, roll_num, n, nsides, rolls + roll_num);
+                    } else {
+                        sums[chunk] += die_faces_total(term_id, roll_num, n, nsides);
+                    }
+                }
+            }
+            for(; roll_num < end; ++roll_num) {
+                long roll = 0;
+                if(!break_print_loop) {
+                    struct rng_stream r;
+                    rng_stream_init(&r, rng_stream_id(term_id, roll_num));
+                    roll = single_dice_outcome(nsides, explode, &r);
+                }
+                if(rolls) {
+                    rolls[roll_num] = roll;
+                }
+                sums[chunk] += roll;
+            }
+        }
+    }
+    #pragma omp taskwait
+    long sum = 0;
+    for(chunk = 0; chunk < nchunks; ++chunk) {
+        sum += sums[chunk];
+    }
+    free(sums);
+    if(discard > 0) {
+        select_smallest(rolls, ndice, discard);
         long remove = 0;
-        for(roll_num = 0; roll_num < d->ndice && roll_num < d->discard; ++roll_num) {
+        long roll_num;
+        for(roll_num = 0; roll_num < ndice && roll_num < discard; ++roll_num) {
             remove += rolls[roll_num];
         }
         sum -= remove;
@@ -148,9 +411,41 @@ long serial_total_dice_outcome(struct roll_encoding *d) {
     return sum;
 }
 
+/*
+   Total of term i of prog, using the method chosen for it at compile time.
+   threads is how many threads' worth of tasks the dice of the term may be
+   split into: 1 unless the plan gives the term's dice threads of their own.
+*/
+long term_outcome(const struct program *prog, long i, uint64_t term_id, int threads) {
+    long ndice = prog->ndice[i];
+    long nsides = prog->nsides[i];
+    bool explode = prog->flags[i] & TERM_EXPLODE;
+    switch(prog->op[i]) {
+        case OP_SINGLE_DIE:
+            {
+                struct rng_stream r;
+                rng_stream_init(&r, rng_stream_id(term_id, 0));
+                return single_dice_outcome(nsides, explode, &r);
+            }
+        case OP_FACE_COUNTS:
+            {
+                struct rng_stream r;
+                rng_stream_init(&r, term_id);
+                return face_count_total(&r, ndice, nsides, prog->discard[i]);
+            }
+        case OP_EXPLODING_AGGREGATE:
+            return exploding_total(term_id, ndice, nsides);
+        case OP_KEEP_HISTOGRAM:
+            return keep_histogram_total(term_id, ndice, nsides, prog->discard[i], threads);
+        case OP_STREAMING_KEEP:
+            return streaming_keep_total(term_id, ndice, nsides, prog->discard[i], explode, threads);
+        default:
+            return rolls_total(term_id, ndice, nsides, prog->discard[i], explode, threads);
+    }
+}
+
 void check_roll_sanity(const struct parse_tree* t) {
-    signal(SIGINT, sigint_handler);
-    break_print_loop = false;
+    install_stop_handlers();
     if(t->dice_specs == NULL) {
         return;
     }
@@ -165,7 +460,7 @@ void check_roll_sanity(const struct parse_tree* t) {
         }
         switch(d->dir) {
             case pos:
-                if(cumulative_dice_range[1] > 0 && ndice > 0 && (LONG_MAX-cumulative_dice_range[1])/d->ndice < d->nsides) {
+                if(cumulative_dice_range[1] >= 0 && ndice > 0 && (LONG_MAX-cumulative_dice_range[1])/d->ndice < d->nsides) {
                     warning = true;
                 } else {
                     cumulative_dice_range[0] += d->nsides;
@@ -173,7 +468,7 @@ void check_roll_sanity(const struct parse_tree* t) {
                 }
                 break;
             case neg:
-                if(cumulative_dice_range[1] < 0 && ndice > 0 && (LONG_MIN-cumulative_dice_range[0])/d->ndice > -d->nsides) {
+                if(cumulative_dice_range[0] <= 0 && ndice > 0 && (LONG_MIN-cumulative_dice_range[0])/d->ndice > -d->nsides) {
                     warning = true;
                 } else {
                     cumulative_dice_range[0] -= ndice*d->nsides;
@@ -195,89 +490,591 @@ void check_roll_sanity(const struct parse_tree* t) {
     }
 }
 
-void parallelised_rep_rolls(const struct parse_tree *t) {
-    if(t->dice_specs == NULL) {
+// Result of one rep of a compiled statement.
+long rep_outcome(const struct program *prog, uint64_t statement_id, long rep, const struct alias_table *table, int die_threads) {
+    uint64_t rep_id = rng_stream_id(statement_id, rep);
+    if(table != NULL) { // The whole rep comes from one draw, so skip the terms.
+        struct rng_stream r;
+        rng_stream_init(&r, rep_id);
+        return alias_sample(table, &r);
+    }
+    long result = prog->constant;
+    long i;
+    for(i = 0; i < prog->nterms && !break_print_loop; ++i) {
+        result += prog->dir[i]*term_outcome(prog, i, rng_stream_id(rep_id, prog->term[i]), die_threads);
+    }
+    return result;
+}
+
+// The statement's program, compiled the first time it is rolled and kept for when it comes round again.
+const struct program *statement_program(struct parse_tree *t) {
+    if(t->prog == NULL) {
+        t->prog = arena_alloc(t->arena, sizeof(struct program));
+        program_compile(t->prog, t, t->arena);
+    }
+    return t->prog;
+}
+
+/*
+   A statement being rolled in pieces by roll_jobs: what roll() works out
+   before the first rep, kept until the last of its results is written.
+*/
+struct job {
+    struct parse_tree *t;
+    const struct program *prog;
+    uint64_t statement_id;
+    struct plan plan;
+    double success_chance; // Of one rep, for PLAN_SUCCESS_COUNT
+    struct alias_table table; // For PLAN_ALIAS, only while the job's reps are being rolled
+    const struct alias_table *use_table;
+    struct progress p;
+    long next_rep; // First rep not yet handed to a piece
+    long piece_size;
+    bool skip; // Finished before the checkpoint being resumed
+    bool started; // Its output has begun
+};
+
+// A run of one job's reps, rolled as one task into a buffer of its own.
+struct piece {
+    struct job *job;
+    long start;
+    long end;
+    long nsuccess;
+};
+
+void job_init(struct job *job, struct parse_tree *t, const struct arguments *args) {
+    job->t = t;
+    job->prog = NULL;
+    job->use_table = NULL;
+    job->started = false;
+    job->success_chance = 0;
+    alias_table_init(&job->table);
+    long statement = statements_rolled++;
+    job->skip = checkpoint_skip(statement);
+    if(!job->skip && !t->checked) {
+        check_roll_sanity(t);
+        t->checked = true;
+    }
+    job->statement_id = rng_stream_id(0, statement_sequence++);
+    job->p = (struct progress){ statement, 0, 0, NULL, NULL, 0 };
+    job->next_rep = t->nreps;
+    job->plan.kind = PLAN_SERIAL;
+    job->plan.rep_threads = 1;
+    job->plan.die_threads = 1;
+    job->plan.cost[PLAN_SERIAL] = 0;
+    if(job->skip) {
         return;
     }
-    long rep = 0;
+    job->prog = statement_program(t);
+    // A whole window of distributions and tables could take gigabytes, so only the plan is kept and job_prepare builds the table later.
+    struct distribution x;
+    distribution_init(&x);
+    plan_statement(t, job->prog, t->nreps, args, &x, &job->plan);
+    if(job->plan.kind == PLAN_SUCCESS_COUNT) {
+        job->success_chance = distribution_at_least(&x, t->threshold);
+    }
+    distribution_free(&x);
+    checkpoint_restore(&job->p, t->nreps);
+    if(t->dice_specs != NULL && job->plan.kind != PLAN_SUCCESS_COUNT) {
+        job->next_rep = job->p.rep;
+        long block = t->nreps - job->p.rep < REP_BLOCK_SIZE ? t->nreps - job->p.rep : REP_BLOCK_SIZE;
+        long pieces = job->plan.rep_threads > 1 ? (long)job->plan.rep_threads*TASKS_PER_THREAD : 1;
+        job->piece_size = (block + pieces - 1)/pieces;
+    }
+}
+
+// Builds the alias table the plan draws reps from, if any, before the first of them is rolled.
+void job_prepare(struct job *job) {
+    if(job->plan.kind != PLAN_ALIAS || job->use_table != NULL) {
+        return;
+    }
+    struct distribution x;
+    distribution_init(&x);
+    expression_distribution(job->t, &x); // Worked out once already when planning, so it cannot fail now.
+    alias_table_build(&job->table, &x);
+    distribution_free(&x);
+    job->use_table = &job->table;
+}
+
+void job_start(struct job *job) {
+    job->started = true;
+    if(job->skip) {
+        return;
+    }
+    const struct parse_tree *t = job->t;
+    long nvalues = t->dice_specs == NULL ? 0 : (t->use_threshold ? 1 : t->nreps);
+    if(job->p.rep == 0) {
+        output_begin_statement(nvalues, t->use_threshold);
+    } else {
+        output_resume_statement(nvalues, t->use_threshold ? 0 : job->p.rep);
+    }
+}
+
+void job_finish(struct job *job) {
+    if(!job->started) {
+        job_start(job);
+    }
+    if(!job->skip) {
+        const struct parse_tree *t = job->t;
+        if(job->plan.kind == PLAN_SUCCESS_COUNT) {
+            struct rng_stream r;
+            rng_stream_init(&r, job->statement_id);
+            output_value(binomial_sample(&r, t->nreps, job->success_chance));
+        } else if(t->use_threshold && t->dice_specs != NULL) {
+            output_value(job->p.nsuccess);
+        }
+        output_end_statement();
+        checkpoint_statement_done(job->p.statement);
+    }
+    alias_table_free(&job->table);
+    job->use_table = NULL;
+}
+
+/*
+   Rolls the piece's reps into b: as text with a space before every rep but
+   the first of the statement, in the binary formats at their fixed width,
+   or, for thresholded statements, just counting the successes.
+*/
+void roll_piece(struct piece *piece, struct out_buffer *b) {
+    const struct job *job = piece->job;
+    const struct parse_tree *t = job->t;
+    bool text = output_format == OUTPUT_TEXT;
     long nsuccess = 0;
-    bool keep_going = true;
-    #pragma omp parallel for private(rep) shared(keep_going)
-    for(rep = 0; rep < t->nreps; ++rep) {
-        if(rep != 0 && !t->use_threshold) {
-            printf(" ");
-        }
-        struct roll_encoding *d = t->dice_specs;
-        long result = 0;
-        while(d != NULL && keep_going) {
-            if(d->ndice > 0 && d->nsides > 0) {
-                result += d->dir * serial_total_dice_outcome(d);
-            }
-            if(d->next != NULL) {
-                d = d->next;
-            } else {
-                d = NULL;
-            }
-            if(break_print_loop) {
-                keep_going = false;
+    long rep;
+    for(rep = piece->start; rep < piece->end; ++rep) {
+        if(break_print_loop) {
+            if(!text && !t->use_threshold) {
+                out_buffer_missing(b);
             }
+            continue;
         }
+        long result = rep_outcome(job->prog, job->statement_id, rep, job->use_table, job->plan.die_threads);
         if(t->use_threshold) {
             nsuccess += result >= t->threshold;
+        } else if(!text) {
+            out_buffer_value(b, result);
         } else {
-            printf("%ld", result);
+            if(rep != 0) {
+                out_buffer_char(b, ' ');
+            }
+            out_buffer_long(b, result);
         }
     }
-    if(t->use_threshold) {
-        printf("%ld", nsuccess);
+    piece->nsuccess = nsuccess;
+}
+
+/*
+   The fast path for statements the plan rolls on one thread, which covers
+   most interactive rolls: no team, no tasks and no buffers, every rep
+   going straight to the output.
+*/
+void serial_job_rolls(struct job *job) {
+    const struct parse_tree *t = job->t;
+    job_prepare(job);
+    job_start(job);
+    long rep;
+    for(rep = job->next_rep; rep < t->nreps && !break_print_loop; ++rep) {
+        // Reading the clock for every rep would cost as much as a small rep, so only look once a block, as the pooled path does.
+        if(rep % REP_BLOCK_SIZE == 0 && checkpoint_due()) {
+            job->p.rep = rep;
+            checkpoint_save(&job->p, t->nreps);
+        }
+        long result = rep_outcome(job->prog, job->statement_id, rep, job->use_table, 1);
+        if(t->use_threshold) {
+            job->p.nsuccess += result >= t->threshold;
+        } else {
+            output_value(result);
+        }
     }
+    job_finish(job);
 }
 
-void serial_rep_rolls(const struct parse_tree *t) {
-    if(t->dice_specs == NULL) {
+/*
+   Pieces and their buffers, kept from line to line so that the buffers
+   only grow the first few times a team is used.
+*/
+struct piece_pool {
+    struct piece *pieces;
+    struct out_buffer *buffers;
+    long capacity;
+};
+
+struct piece_pool piece_pool = { NULL, NULL, 0 };
+
+void piece_pool_reserve(long capacity) {
+    if(capacity <= piece_pool.capacity) {
         return;
     }
-    long rep = 0;
-    long nsuccess = 0;
-    for(rep = 0; rep < t->nreps; ++rep) {
-        if(rep != 0 && !t->use_threshold) {
-            printf(" ");
-        }
-        struct roll_encoding *d = t->dice_specs;
-        long result = 0;
-        while(d != NULL) {
-            if(d->ndice > 0 && d->nsides > 0) {
-                result += d->dir * parallelised_total_dice_outcome(d);
-            }
-            if(d->next != NULL) {
-                d = d->next;
-            } else {
-                d = NULL;
+    struct piece *pieces = realloc(piece_pool.pieces, sizeof(struct piece)*capacity);
+    struct out_buffer *buffers = realloc(piece_pool.buffers, sizeof(struct out_buffer)*capacity);
+    if(!pieces || !buffers) {
+        fprintf(stderr, "Error allocating memory.\n");
+        exit(1);
+    }
+    long i;
+    for(i = piece_pool.capacity; i < capacity; ++i) {
+        out_buffer_init(&buffers[i]);
+    }
+    piece_pool.pieces = pieces;
+    piece_pool.buffers = buffers;
+    piece_pool.capacity = capacity;
+}
+
+void piece_pool_free() {
+    long i;
+    for(i = 0; i < piece_pool.capacity; ++i) {
+        out_buffer_free(&piece_pool.buffers[i]);
+    }
+    free(piece_pool.pieces);
+    free(piece_pool.buffers);
+    piece_pool.pieces = NULL;
+    piece_pool.buffers = NULL;
+    piece_pool.capacity = 0;
+}
+
+/*
+   Rolls the jobs' reps in pieces, several per thread for statements
+   planned to share out their reps, handed out a wave at a time to one team
+   that lasts for all the waves. While a piece waits on the dice of a big
+   term, which are split into tasks of their own, idle threads take those
+   on too, so work is balanced wherever it sits: in separate statements, in
+   reps or in dice. After each wave the pieces' buffers are written out in
+   statement and rep order, so the output is the same as rolling everything
+   one at a time.
+*/
+void pooled_job_rolls(struct job *jobs, long njobs, int team) {
+    long max_pieces = 2L*team*TASKS_PER_THREAD;
+    piece_pool_reserve(max_pieces);
+    struct piece *pieces = piece_pool.pieces;
+    struct out_buffer *buffers = piece_pool.buffers;
+    #pragma omp parallel num_threads(team)
+    #pragma omp single
+    {
+        long next_job = 0; // Where the next wave's pieces come from
+        long done = 0; // Jobs before this one have been finished
+        for(;;) {
+            long npieces = 0;
+            long wave_reps = 0;
+            while(next_job < njobs && npieces < max_pieces && wave_reps < WAVE_REPS && !break_print_loop) {
+                struct job *job = &jobs[next_job];
+                if(job->next_rep >= job->t->nreps) {
+                    ++next_job;
+                    continue;
+                }
+                job_prepare(job);
+                long end = job->t->nreps - job->next_rep > job->piece_size ? job->next_rep + job->piece_size : job->t->nreps;
+                pieces[npieces++] = (struct piece){ job, job->next_rep, end, 0 };
+                wave_reps += end - job->next_rep;
+                job->next_rep = end;
             }
-            if(break_print_loop) {
+            if(npieces == 0) {
                 break;
             }
+            long i;
+            for(i = 0; i < npieces; ++i) {
+                #pragma omp task firstprivate(i)
+                roll_piece(&pieces[i], &buffers[i]);
+            }
+            #pragma omp taskwait
+            long next;
+            for(i = 0; i < npieces; i = next) {
+                struct job *job = pieces[i].job;
+                while(&jobs[done] != job) {
+                    job_finish(&jobs[done++]);
+                }
+                if(!job->started) {
+                    job_start(job);
+                }
+                for(next = i; next < npieces && pieces[next].job == job; ++next) {
+                    job->p.nsuccess += pieces[next].nsuccess;
+                }
+                job->p.rep = pieces[next - 1].end;
+                if(!job->t->use_threshold) {
+                    output_buffers(&buffers[i], next - i);
+                    output_count_values(job->p.rep - pieces[i].start);
+                }
+                if(checkpoint_due()) {
+                    checkpoint_save(&job->p, job->t->nreps);
+                }
+            }
         }
-        if(t->use_threshold) {
-            nsuccess += result >= t->threshold;
-        } else {
-            printf("%ld", result);
+        while(done < njobs) {
+            job_finish(&jobs[done++]);
         }
     }
-    if(t->use_threshold) {
-        printf("%ld", nsuccess);
+}
+
+/*
+   Rolls the next njobs statements from t on, skipping suppressed ones.
+   They are planned first; if none is worth a team of threads, and together
+   they are too small to be worth one either, they are rolled one after
+   another on this thread, otherwise all together by one team.
+*/
+void roll_jobs(struct parse_tree *t, long njobs, const struct arguments *args) {
+    struct job single;
+    struct job *jobs = njobs == 1 ? &single : malloc(sizeof(struct job)*njobs);
+    if(!jobs) {
+        fprintf(stderr, "Error allocating memory.\n");
+        exit(1);
+    }
+    install_stop_handlers();
+    int team = 1;
+    double estimate = 0;
+    long j;
+    for(j = 0; j < njobs; ++j, t = t->next) {
+        while(t->suppress) {
+            t = t->next;
+        }
+        job_init(&jobs[j], t, args);
+        int threads = jobs[j].plan.rep_threads*jobs[j].plan.die_threads;
+        team = threads > team ? threads : team;
+        estimate += jobs[j].plan.cost[jobs[j].plan.kind] > 0 ? jobs[j].plan.cost[jobs[j].plan.kind] : 0;
+    }
+    // Statements that are each too small to share out may still be worth rolling side by side.
+    if(njobs > 1 && omp_get_max_threads() > 1 && 1e9*estimate > calibration_estimate()->fork_ns) {
+        team = omp_get_max_threads();
+    }
+    if(team > 1) {
+        pooled_job_rolls(jobs, njobs, team);
+    } else {
+        for(j = 0; j < njobs; ++j) {
+            serial_job_rolls(&jobs[j]);
+        }
+    }
+    if(jobs != &single) {
+        free(jobs);
     }
 }
 
-void roll(const struct parse_tree *t) {
-    signal(SIGINT, sigint_handler);
-    break_print_loop = false;
-    check_roll_sanity(t);
-    if(t->nreps > t->ndice) {
-        parallelised_rep_rolls(t);
+/*
+   The part [*start, *end) of n units of work that falls to this process:
+   everything, or with --shard its share of n split as evenly as possible.
+*/
+void shard_range(long n, const struct arguments *args, long *start, long *end) {
+    if(args->shard_count <= 0) {
+        *start = 0;
+        *end = n;
+        return;
+    }
+    split_range(n, args->shard_count, args->shard_index, start, end);
+}
+
+/*
+   Each of nthreads tasks summarises its own contiguous run of each block
+   of reps, split as evenly as possible; the summaries are merged in order
+   at the end, so nothing is printed per rep. Checkpoints keep them apart,
+   since merging them any sooner would change the t-digest.
+*/
+void aggregated_rep_rolls(const struct parse_tree *t, const struct program *prog, uint64_t statement_id, long start, long end, struct progress *p, int nthreads, int die_threads) {
+    struct aggregate *partial = malloc(sizeof(struct aggregate)*nthreads);
+    if(!partial) {
+        fprintf(stderr, "Error allocating memory.\n");
+        exit(1);
+    }
+    int part;
+    for(part = 0; part < nthreads; ++part) {
+        aggregate_init(&partial[part], t->use_threshold, t->threshold);
+    }
+    p->parts = partial;
+    p->nparts = nthreads;
+    checkpoint_restore_parts(p);
+    long block_start;
+    for(block_start = start > p->rep ? start : p->rep; block_start < end && !break_print_loop; block_start += REP_BLOCK_SIZE) {
+        long block_end = end - block_start > REP_BLOCK_SIZE ? block_start + REP_BLOCK_SIZE : end;
+        #pragma omp parallel num_threads(nthreads*die_threads) if(nthreads*die_threads > 1)
+        #pragma omp single
+        for(part = 0; part < nthreads; ++part) {
+            #pragma omp task firstprivate(part)
+            {
+                long first, last;
+                split_range(block_end - block_start, nthreads, part, &first, &last);
+                long rep;
+                for(rep = block_start + first; rep < block_start + last && !break_print_loop; ++rep) {
+                    aggregate_add(&partial[part], rep_outcome(prog, statement_id, rep, NULL, die_threads));
+                }
+            }
+        }
+        if(checkpoint_due()) {
+            p->rep = block_end;
+            checkpoint_save(p, t->nreps);
+        }
+    }
+    for(part = 0; part < nthreads; ++part) {
+        aggregate_merge(p->agg, &partial[part]);
+    }
+    p->parts = NULL;
+    p->nparts = 0;
+    free(partial);
+}
+
+/*
+   When the distribution of a rep is known, how many reps land on each
+   outcome is multinomial, and drawing it as a run of binomials, one per
+   outcome, fills in the histogram without rolling a single rep. The reps
+   are drawn a block at a time, each block from its own stream, so that
+   shards can take whole blocks and still add up to a single run.
+*/
+void aggregated_multinomial(const struct distribution *x, long nreps, uint64_t statement_id, const struct arguments *args, struct progress *p) {
+    double total = 0;
+    long i;
+    for(i = 0; i < x->len; ++i) {
+        total += x->p[i];
+    }
+    // Blocks should dwarf the support, or the binomials cost more than the reps.
+    long block_size = x->len > MULTINOMIAL_BLOCK_SIZE/64 ? 64*x->len : MULTINOMIAL_BLOCK_SIZE;
+    long first, last;
+    shard_range(nreps/block_size + (nreps%block_size != 0), args, &first, &last);
+    long block;
+    for(block = first > p->rep ? first : p->rep; block < last && !break_print_loop; ++block) {
+        struct rng_stream r;
+        rng_stream_init(&r, rng_stream_id(statement_id, block));
+        long remaining = nreps - block*block_size < block_size ? nreps - block*block_size : block_size;
+        double mass = total;
+        for(i = 0; i < x->len && remaining > 0; ++i) {
+            double q = i == x->len - 1 || x->p[i] >= mass ? 1 : x->p[i]/mass;
+            long count = binomial_sample(&r, remaining, q);
+            aggregate_add_count(p->agg, x->min + i, count);
+            remaining -= count;
+            mass -= x->p[i];
+        }
+        if(checkpoint_due()) {
+            p->rep = block + 1;
+            checkpoint_save(p, nreps);
+        }
+    }
+}
+
+void aggregate_statement(const struct parse_tree *t, const struct program *prog, uint64_t statement_id, const struct arguments *args, struct progress *p) {
+    struct aggregate agg;
+    aggregate_init(&agg, t->use_threshold, t->threshold);
+    p->agg = &agg;
+    checkpoint_restore(p, t->nreps);
+    struct distribution x;
+    distribution_init(&x);
+    if(t->dice_specs != NULL) {
+        long start, end;
+        shard_range(t->nreps, args, &start, &end);
+        struct plan plan;
+        plan_statement(t, prog, end - start, args, &x, &plan);
+        if(plan.kind == PLAN_MULTINOMIAL) {
+            aggregated_multinomial(&x, t->nreps, statement_id, args, p);
+        } else {
+            aggregated_rep_rolls(t, prog, statement_id, start, end, p, plan.rep_threads, plan.die_threads);
+        }
+    }
+    if(args->shard_count > 0) {
+        write_aggregate(&agg, statement_hash(t));
     } else {
-        serial_rep_rolls(t);
+        print_aggregate(&agg);
+    }
+    aggregate_free(&agg);
+    distribution_free(&x);
+}
+
+// Print how the statement would be carried out, and the estimated cost, instead of rolling it.
+void explain_statement(struct parse_tree *t, const struct arguments *args) {
+    if(args->shard_count > 0) {
+        fprintf(stderr, "Plans cannot be split into shards.\n");
+        return;
+    }
+    if(output_format != OUTPUT_TEXT) {
+        fprintf(stderr, "Plans can only be printed as text.\n");
+        return;
+    }
+    struct distribution x;
+    distribution_init(&x);
+    struct plan plan;
+    plan_statement(t, statement_program(t), t->nreps, args, &x, &plan);
+    print_plan(&plan);
+    distribution_free(&x);
+}
+
+// Plain statements, unlike summaries, exact odds and plans, are rolled in pieces and can share a team with their neighbours.
+bool rolled_in_pieces(const struct parse_tree *t, const struct arguments *args) {
+    return !t->explain && !t->exact && !t->aggregate && args->shard_count <= 0;
+}
+
+void roll(struct parse_tree *t, const struct arguments *args) {
+    if(rolled_in_pieces(t, args)) {
+        roll_jobs(t, 1, args);
+        return;
+    }
+    install_stop_handlers();
+    long statement = statements_rolled++;
+    bool skip = checkpoint_skip(statement);
+    if(t->explain) {
+        if(!skip) {
+            explain_statement(t, args);
+        }
+        return;
+    }
+    if(t->exact) {
+        if(skip) {
+            return;
+        }
+        if(args->shard_count > 0) {
+            fprintf(stderr, "Exact odds cannot be split into shards.\n");
+            return;
+        }
+        if(output_format != OUTPUT_TEXT) {
+            fprintf(stderr, "Exact odds can only be printed as text.\n");
+            return;
+        }
+        struct distribution x;
+        distribution_init(&x);
+        if(0 == statement_distribution(t, &x)) {
+            print_distribution(&x);
+        }
+        distribution_free(&x);
+        return;
+    }
+    if(!skip && !t->checked) {
+        check_roll_sanity(t);
+        t->checked = true;
+    }
+    uint64_t statement_id = rng_stream_id(0, statement_sequence++);
+    if(skip) {
+        return;
+    }
+    if(output_format != OUTPUT_TEXT) {
+        fprintf(stderr, "Summaries can only be printed as text.\n");
+        return;
+    }
+    struct progress p = { statement, 0, 0, NULL, NULL, 0 };
+    aggregate_statement(t, statement_program(t), statement_id, args, &p);
+    checkpoint_statement_done(statement);
+}
+
+/*
+   Rolls the statements of a line in order. Runs of plain statements go to
+   roll_jobs together, up to JOB_WINDOW at a time, so that short statements
+   next to long ones still keep every thread busy. With checkpoints each
+   statement is rolled on its own, since a checkpoint can only record one
+   statement in progress.
+*/
+void roll_line(struct parse_tree *t, const struct arguments *args) {
+    while(t != NULL) {
+        if(t->suppress) {
+            t = t->next;
+            continue;
+        }
+        if(!rolled_in_pieces(t, args)) {
+            roll(t, args);
+            t = t->next;
+            continue;
+        }
+        struct parse_tree *first = t;
+        long njobs = 0;
+        while(t != NULL && njobs < JOB_WINDOW && (t->suppress || rolled_in_pieces(t, args))) {
+            if(!t->suppress) {
+                if(njobs > 0 && checkpoint_enabled()) {
+                    break;
+                }
+                ++njobs;
+            }
+            t = t->next;
+        }
+        roll_jobs(first, njobs, args);
     }
-    printf("\n");
     #pragma omp flush
 }
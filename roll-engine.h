@@ -1,9 +1,19 @@
 #ifndef __ROLL_ENGINE_H__
 #define __ROLL_ENGINE_H__
+#include "io.h"
 #include "parse.h"
+#include "rng.h"
+
+#define REP_BLOCK_SIZE (1L << 16) // Reps rolled between checks for interrupts and checkpoints
+#define MULTINOMIAL_BLOCK_SIZE (1L << 16) // Reps per multinomial draw, each from its own stream
+#define TASKS_PER_THREAD 4 // Tasks work is split into per thread, so early finishers can take over the rest
+#define WAVE_REPS (2*REP_BLOCK_SIZE) // Reps handed out at a time before their results are written
+#define JOB_WINDOW 1024 // Statements of a line rolled together
 
-void dice_reset(struct roll_encoding *);
 void dice_init(struct roll_encoding *);
-void roll(const struct parse_tree *);
+long die_face(struct rng_stream *r, long nsides);
+void roll(struct parse_tree *, const struct arguments *);
+void roll_line(struct parse_tree *, const struct arguments *);
+void piece_pool_free();
 void print_dice_specs(const struct roll_encoding *d);
 #endif // __ROLL_ENGINE_H__
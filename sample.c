@@ -0,0 +1,205 @@
+#include <limits.h>
+#include <math.h>
+
+#include "rng.h"
+#include "sample.h"
+
+// Below these means, inversion is cheaper than setting up rejection sampling.
+#define BINOMIAL_INVERSION_MAX_MEAN 10.0
+#define POISSON_INVERSION_MAX_MEAN 10.0
+// Below this many trials, a negative binomial is cheaper as a sum of geometrics.
+#define NEGATIVE_BINOMIAL_MIN_MIXTURE 16
+
+// A whole number x as a long, pinned at LONG_MAX where converting it would be undefined.
+long clamp_to_long(double x) {
+    return x >= (double)LONG_MAX ? LONG_MAX : (long)x;
+}
+
+long binomial_inversion(struct rng_stream *r, long n, double p) {
+    double q = 1 - p;
+    double s = p/q;
+    double a = (n + 1)*s;
+    double prob = exp(n*log(q));
+    double u = rng_unif(r);
+    long x = 0;
+    while(u > prob && x < n) {
+        u -= prob;
+        ++x;
+        prob *= a/x - s;
+    }
+    return x;
+}
+
+/*
+   Transformed rejection with squeeze, for n*p >= 10 and p <= 0.5.
+   Ref: Hörmann, "The generation of binomial random variates",
+        J. Statist. Comput. Simul. 46 (1993), algorithm BTRS.
+*/
+long binomial_btrs(struct rng_stream *r, long n, double p) {
+    double q = 1 - p;
+    double spq = sqrt(n*p*q);
+    double b = 1.15 + 2.53*spq;
+    double a = -0.0873 + 0.0248*b + 0.01*p;
+    double c = n*p + 0.5;
+    double vr = 0.92 - 4.2/b;
+    double alpha = (2.83 + 5.1/b)*spq;
+    double lpq = log(p/q);
+    double m = floor((n + 1)*p);
+    double h = lgamma(m + 1) + lgamma(n - m + 1);
+    while(1) {
+        double u = rng_unif(r) - 0.5;
+        double v = rng_unif(r);
+        double us = 0.5 - fabs(u);
+        double k = floor((2*a/us + b)*u + c);
+        if(k < 0 || k > n) {
+            continue;
+        }
+        if(us >= 0.07 && v <= vr) {
+            return (long)k;
+        }
+        v = log(v*alpha/(a/(us*us) + b));
+        if(v <= h - lgamma(k + 1) - lgamma(n - k + 1) + (k - m)*lpq) {
+            return (long)k;
+        }
+    }
+}
+
+// Number of successes in n independent trials each succeeding with probability p.
+long binomial_sample(struct rng_stream *r, long n, double p) {
+    if(n <= 0 || p <= 0) {
+        return 0;
+    } else if(p >= 1) {
+        return n;
+    } else if(p > 0.5) {
+        return n - binomial_sample(r, n, 1 - p);
+    } else if(n*p < BINOMIAL_INVERSION_MAX_MEAN) {
+        return binomial_inversion(r, n, p);
+    } else {
+        return binomial_btrs(r, n, p);
+    }
+}
+
+/*
+   Distribute n fair k-sided dice over their faces, writing the number of
+   dice showing face f+1 to counts[f]. Each face takes a binomial share of
+   the dice not yet assigned to a lower face, so the cost is O(k) draws.
+*/
+void uniform_multinomial_sample(struct rng_stream *r, long n, long k, long *counts) {
+    long remaining = n;
+    long face;
+    for(face = 0; face < k; ++face) {
+        if(face == k - 1) {
+            counts[face] = remaining;
+        } else {
+            counts[face] = binomial_sample(r, remaining, 1.0/(k - face));
+        }
+        remaining -= counts[face];
+    }
+}
+
+// Standard normal by the Box-Muller transform.
+double normal_sample(struct rng_stream *r) {
+    double u = 1 - rng_unif(r); // (0, 1], so the log is finite.
+    double v = rng_unif(r);
+    return sqrt(-2*log(u))*cos(2*M_PI*v);
+}
+
+/*
+   Gamma with unit scale.
+   Ref: Marsaglia & Tsang, "A simple method for generating gamma variables",
+        ACM TOMS 26 (2000).
+*/
+double gamma_sample(struct rng_stream *r, double shape) {
+    if(shape < 1) {
+        double u = 1 - rng_unif(r);
+        return gamma_sample(r, shape + 1)*pow(u, 1/shape);
+    }
+    double d = shape - 1.0/3;
+    double c = 1/sqrt(9*d);
+    while(1) {
+        double x = normal_sample(r);
+        double v = 1 + c*x;
+        if(v <= 0) {
+            continue;
+        }
+        v = v*v*v;
+        double u = 1 - rng_unif(r);
+        if(log(u) < 0.5*x*x + d - d*v + d*log(v)) {
+            return d*v;
+        }
+    }
+}
+
+long poisson_inversion(struct rng_stream *r, double lambda) {
+    double limit = exp(-lambda);
+    double prod = rng_unif(r);
+    long k = 0;
+    while(prod > limit) {
+        prod *= rng_unif(r);
+        ++k;
+    }
+    return k;
+}
+
+/*
+   Transformed rejection with squeeze, for lambda >= 10.
+   Ref: Hörmann, "The transformed rejection method for generating Poisson
+        random variables", Insurance: Mathematics and Economics 12 (1993).
+*/
+long poisson_ptrs(struct rng_stream *r, double lambda) {
+    double slam = sqrt(lambda);
+    double loglam = log(lambda);
+    double b = 0.931 + 2.53*slam;
+    double a = -0.059 + 0.02483*b;
+    double invalpha = 1.1239 + 1.1328/(b - 3.4);
+    double vr = 0.9277 - 3.6224/(b - 2);
+    while(1) {
+        double u = rng_unif(r) - 0.5;
+        double v = rng_unif(r);
+        double us = 0.5 - fabs(u);
+        double k = floor((2*a/us + b)*u + lambda + 0.43);
+        if(us >= 0.07 && v <= vr) {
+            return clamp_to_long(k);
+        }
+        if(k < 0 || (us < 0.013 && v > us)) {
+            continue;
+        }
+        if(log(v) + log(invalpha) - log(a/(us*us) + b) <= -lambda + k*loglam - lgamma(k + 1)) {
+            return clamp_to_long(k);
+        }
+    }
+}
+
+long poisson_sample(struct rng_stream *r, double lambda) {
+    if(lambda <= 0) {
+        return 0;
+    } else if(lambda < POISSON_INVERSION_MAX_MEAN) {
+        return poisson_inversion(r, lambda);
+    } else {
+        return poisson_ptrs(r, lambda);
+    }
+}
+
+// How many events of probability q happen in a row before the first miss.
+// This is the number of times a die with max face probability q explodes.
+long geometric_sample(struct rng_stream *r, double q) {
+    if(q <= 0) {
+        return 0;
+    }
+    double u = 1 - rng_unif(r);
+    return clamp_to_long(floor(log(u)/log(q)));
+}
+
+// Total of n independent geometric_sample(r, q) draws, by the gamma-Poisson mixture.
+long negative_binomial_sample(struct rng_stream *r, long n, double q) {
+    if(n < NEGATIVE_BINOMIAL_MIN_MIXTURE) {
+        long total = 0;
+        long i;
+        for(i = 0; i < n; ++i) {
+            long g = geometric_sample(r, q);
+            total = g > LONG_MAX - total ? LONG_MAX : total + g;
+        }
+        return total;
+    }
+    return poisson_sample(r, gamma_sample(r, (double)n)*q/(1 - q));
+}
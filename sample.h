@@ -0,0 +1,12 @@
+#ifndef __SAMPLE_H__
+#define __SAMPLE_H__
+#include "rng.h"
+
+long binomial_sample(struct rng_stream *r, long n, double p);
+void uniform_multinomial_sample(struct rng_stream *r, long n, long k, long *counts);
+double normal_sample(struct rng_stream *r);
+double gamma_sample(struct rng_stream *r, double shape);
+long poisson_sample(struct rng_stream *r, double lambda);
+long geometric_sample(struct rng_stream *r, double q);
+long negative_binomial_sample(struct rng_stream *r, long n, double q);
+#endif // __SAMPLE_H__
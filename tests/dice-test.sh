@@ -1,12 +1,16 @@
 #! /bin/bash
 
-./dice <<< 3d6
-./dice <<< "5x 7d8 + 23"
-./dice <<< "5x d4 + 2 + d6"
-./dice <<< ";;;;;;"
-./dice <<< "-1-2-3-4"
-./dice <<< "4x-1-2-3-4"
-./dice <<< 4x-1-2d4-d6-1
+# Run from anywhere: the dice being tested is the one built next to tests/.
+dice="$(cd "$(dirname "$0")/.." && pwd)/dice"
+
+"$dice" <<< 3d6
+"$dice" <<< "5x 7d8 + 23"
+"$dice" <<< "5x d4 + 2 + d6"
+"$dice" <<< ";;;;;;"
+"$dice" <<< "-1-2-3-4"
+"$dice" <<< "4x-1-2-3-4"
+"$dice" <<< 4x-1-2d4-d6-1
+"$dice" <<< "99999999999999999999d6"
 
 hash datamash 2> /dev/null \
     || 1>&2 echo "Datamash not found"
@@ -15,11 +19,66 @@ hash datamash 2>/dev/null \
     echo "Testing pipes in a for-loop:"
     for att in STR DEX CON INT WIS CHA; do
         printf "%s: " $att
-        echo "4x d6" | ./dice | xargs -n1 | sort | tail --lines=+2 | datamash sum 1
+        echo "4x d6" | "$dice" | xargs -n1 | sort | tail --lines=+2 | datamash sum 1
     done
     echo "Testing semi-colon delimiters from a here-string:"
     for att in STR DEX CON INT WIS CHA; do
         printf "%s: " $att
-        ./dice <<< "d6; d6; d6; d6" | sort | tail --lines=+2 | datamash sum 1
+        "$dice" <<< "d6; d6; d6; d6" | sort | tail --lines=+2 | datamash sum 1
     done
 }
+
+# The rolls for a seed must not depend on how the work is split up.
+status=0
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+# Runs a command, failing the tests if it does.
+run() {
+    if ! "$@"; then
+        echo "FAILED: $*"
+        status=1
+    fi
+}
+# Compares two outputs, failing the tests if they differ or either is missing or empty.
+same() {
+    if [ -s "$2" ] && [ -s "$3" ] && cmp -s "$2" "$3"; then
+        echo "$1: same"
+    else
+        echo "$1: DIFFERENT"
+        status=1
+    fi
+}
+# Rolls the script in $2 with seed 42 into $1, stopping it after a moment to resume it from a checkpoint.
+roll_resumed() {
+    timeout -s TERM 0.2 "$dice" -s 42 --checkpoint="$tmp/run.ckpt" --checkpoint-interval=0 --output-file="$1" <<< "$2" 2> /dev/null
+    if [ -f "$tmp/run.ckpt" ]; then # Otherwise it finished before it could be stopped.
+        run "$dice" --checkpoint="$tmp/run.ckpt" --output-file="$1" --resume <<< "$2"
+    fi
+}
+
+echo "Testing that the number of threads does not change the rolls:"
+script="d100; 100000x 4d6k3; 20x 50000d6!; 1000x 3d6 t 10; 5x 100000d1000000k50; aggregate 100000x 2d20"
+OMP_NUM_THREADS=1 run "$dice" -s 42 --output-file="$tmp/1.out" <<< "$script"
+OMP_NUM_THREADS=4 run "$dice" -s 42 --output-file="$tmp/4.out" <<< "$script"
+same "1 and 4 threads" "$tmp/1.out" "$tmp/4.out"
+
+echo "Testing that merged shards match a single --aggregate run:"
+script="100000x 3d6 + d20; 50000x 4d6k3 t 12; 20000x 10d6!; 3000000x 2d6"
+for i in 0 1 2; do
+    run "$dice" -s 42 --shard $i/3 --output-file="$tmp/part$i.agg" <<< "$script"
+done
+run "$dice" merge "$tmp"/part0.agg "$tmp"/part1.agg "$tmp"/part2.agg > "$tmp/merged.out"
+run "$dice" -s 42 --aggregate --output-file="$tmp/aggregate.out" <<< "$script"
+same "3 shards" "$tmp/merged.out" "$tmp/aggregate.out"
+
+echo "Testing that an interrupted and resumed run matches an uninterrupted one:"
+script="10000000x 3d6 + d4; 20x 50000d6!; 10000000x d20 t 11; 5000000x 4d6k3"
+run "$dice" -s 42 --output-file="$tmp/whole.out" <<< "$script"
+roll_resumed "$tmp/resumed.out" "$script"
+same "resumed run" "$tmp/whole.out" "$tmp/resumed.out"
+# Wide enough for the summary to go over to the t-digest, whose quantiles depend on the order of merges.
+script="aggregate 3000000x 3d6 + d4 + d1000000; aggregate 1000000x 4d6k3"
+run "$dice" -s 42 --output-file="$tmp/whole.out" <<< "$script"
+roll_resumed "$tmp/resumed.out" "$script"
+same "resumed summary" "$tmp/whole.out" "$tmp/resumed.out"
+exit $status
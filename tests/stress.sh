@@ -0,0 +1,52 @@
+#! /bin/bash
+
+# Huge expressions and lines must be handled in linear time on a small stack.
+# Each case is run with N and then 2N terms or statements under a 1 MiB stack;
+# doubling the input should roughly double the time.
+# Usage: tests/stress.sh [N] (Default: 1000000)
+
+N=${1:-1000000}
+STACK_KB=1024
+INPUT=$(mktemp)
+trap 'rm -f "$INPUT"' EXIT
+
+terms() {
+    printf 'd6'
+    yes '+d6' | head -n "$1" | tr -d '\n'
+    echo
+}
+
+statements() {
+    yes 'd6;' | head -n "$1" | tr -d '\n'
+    echo
+}
+
+# Every term is prone to overflow, so the warning prints the whole expression.
+overflowing_terms() {
+    printf 'd6'
+    yes '+4611686018427387904d6' | head -n "$1" | tr -d '\n'
+    echo
+}
+
+seconds() {
+    (
+        ulimit -s "$STACK_KB"
+        start=$EPOCHREALTIME
+        ./dice -s 1 "$INPUT" > /dev/null 2>&1 || exit 1
+        awk -v a="$start" -v b="$EPOCHREALTIME" 'BEGIN { printf "%.3f\n", b - a }'
+    )
+}
+
+status=0
+for generate in terms statements overflowing_terms; do
+    "$generate" "$N" > "$INPUT"
+    t1=$(seconds) || { echo "$generate $N: failed"; status=1; continue; }
+    "$generate" $((2*N)) > "$INPUT"
+    t2=$(seconds) || { echo "$generate $((2*N)): failed"; status=1; continue; }
+    echo "$generate: $N in ${t1}s, $((2*N)) in ${t2}s"
+    if awk -v a="$t1" -v b="$t2" 'BEGIN { exit !(b > 3*a + 0.1) }'; then
+        echo "$generate: time grows faster than the input"
+        status=1
+    fi
+done
+exit $status
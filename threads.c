@@ -0,0 +1,144 @@
+#define _GNU_SOURCE 1 // Needed for sched_setaffinity and the CPU_* macros.
+#include <ctype.h>
+#include <errno.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef _OPENMP
+#include <omp.h>
+#else
+#define omp_get_max_threads() 1
+#define omp_get_thread_num() 0
+#define omp_set_num_threads(threads)
+#endif
+
+#include "threads.h"
+
+/*
+   Reads an --affinity argument: compact, spread, or a list of CPUs and
+   ranges of CPUs such as 0-3,8,10-11, as taskset -c takes them.
+*/
+int affinity_parse(const char *arg, struct affinity *a) {
+    a->ncpus = 0;
+    if(0 == strcmp(arg, "compact")) {
+        a->policy = AFFINITY_COMPACT;
+        return 0;
+    }
+    if(0 == strcmp(arg, "spread")) {
+        a->policy = AFFINITY_SPREAD;
+        return 0;
+    }
+    a->policy = AFFINITY_LIST;
+    const char *s = arg;
+    while(*s != '\0') {
+        char *endptr;
+        if(!isdigit(*s)) {
+            return 1;
+        }
+        errno = 0;
+        long first = strtol(s, &endptr, 10);
+        long last = first;
+        if(*endptr == '-') {
+            s = endptr + 1;
+            if(!isdigit(*s)) {
+                return 1;
+            }
+            last = strtol(s, &endptr, 10);
+        }
+        if(errno != 0 || last < first || last >= CPU_SETSIZE) {
+            return 1;
+        }
+        long cpu;
+        for(cpu = first; cpu <= last; ++cpu) {
+            if(a->ncpus == AFFINITY_MAX_CPUS) {
+                return 1;
+            }
+            a->cpus[a->ncpus++] = cpu;
+        }
+        s = endptr;
+        if(*s == ',') {
+            ++s;
+            if(*s == '\0') {
+                return 1;
+            }
+        } else if(*s != '\0') {
+            return 1;
+        }
+    }
+    return a->ncpus > 0 ? 0 : 1;
+}
+
+/*
+   The CPUs the process was started on, eg restricted by taskset or a
+   cgroup, in order. They are read once, before any thread is pinned,
+   since pinning the main thread narrows what it would see afterwards.
+*/
+int allowed_cpus[CPU_SETSIZE];
+int nallowed_cpus = 0;
+
+void find_allowed_cpus() {
+    if(nallowed_cpus > 0) {
+        return;
+    }
+    cpu_set_t set;
+    if(0 != sched_getaffinity(0, sizeof(set), &set)) {
+        fprintf(stderr, "Error %d (%s) finding which CPUs may be used.\n", errno, strerror(errno));
+        allowed_cpus[0] = 0;
+        nallowed_cpus = 1;
+        return;
+    }
+    int cpu;
+    for(cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+        if(CPU_ISSET(cpu, &set)) {
+            allowed_cpus[nallowed_cpus++] = cpu;
+        }
+    }
+}
+
+int thread_cpu(const struct affinity *a, int thread, int team) {
+    switch(a->policy) {
+        case AFFINITY_SPREAD:
+            if(team < nallowed_cpus) {
+                return allowed_cpus[(long)thread*nallowed_cpus/team];
+            }
+            return allowed_cpus[thread%nallowed_cpus];
+        case AFFINITY_LIST:
+            return a->cpus[thread%a->ncpus];
+        default:
+            return allowed_cpus[thread%nallowed_cpus];
+    }
+}
+
+/*
+   Caps the threads at threads, if it is positive, and pins each thread of
+   a full team to a CPU as a chooses. OpenMP keeps the same threads from
+   one parallel region to the next, so they stay where they are put; later
+   teams that are smaller use the first of them.
+*/
+void threads_configure(int threads, const struct affinity *a) {
+    if(threads > 0) {
+        omp_set_num_threads(threads);
+    }
+    if(a->policy == AFFINITY_NONE) {
+        return;
+    }
+    find_allowed_cpus();
+    int team = omp_get_max_threads();
+    bool failed = false;
+    #pragma omp parallel num_threads(team)
+    {
+        int cpu = thread_cpu(a, omp_get_thread_num(), team);
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        if(0 != sched_setaffinity(0, sizeof(set), &set)) {
+            #pragma omp atomic write
+            failed = true;
+        }
+    }
+    if(failed) {
+        fprintf(stderr, "Warning: some threads could not be pinned to the CPUs asked for.\n");
+    }
+}
@@ -0,0 +1,21 @@
+#ifndef __THREADS_H__
+#define __THREADS_H__
+
+typedef enum affinity_policy {
+    AFFINITY_NONE = 0, // Leave the threads where the system puts them
+    AFFINITY_COMPACT, // Thread i on the ith CPU we may use, so the team shares as few cores and sockets as it can
+    AFFINITY_SPREAD, // Threads evenly spaced over the CPUs we may use
+    AFFINITY_LIST // Thread i on the ith CPU of a list, wrapping round
+} affinity_policy;
+
+#define AFFINITY_MAX_CPUS 1024
+
+struct affinity {
+    affinity_policy policy;
+    int ncpus; // Length of cpus, for AFFINITY_LIST
+    int cpus[AFFINITY_MAX_CPUS];
+};
+
+int affinity_parse(const char *arg, struct affinity *a);
+void threads_configure(int threads, const struct affinity *a);
+#endif // __THREADS_H__
@@ -1,4 +1,7 @@
+#define _GNU_SOURCE 1 // Needed for qsort_r
+#include <stdio.h>
 #include <stdlib.h>
+#include <stdbool.h>
 
 #include "util.h"
 
@@ -12,3 +15,115 @@ int integer_difference_sign(const void *a, const void *b, void *data) {
     long n2 = *((long*)b);
     return (n1 > n2) - (n1 < n2);
 }
+
+/*
+   Rearrange a[0..n) so that its k smallest entries come first, in no
+   particular order. Quickselect with median-of-three pivots, falling back
+   to a full sort if the partitions keep coming out lopsided (introselect).
+*/
+void select_smallest(long *a, long n, long k) {
+    if(k <= 0 || k >= n) {
+        return;
+    }
+    long target = k - 1;
+    long lo = 0;
+    long hi = n - 1;
+    int depth_limit = 2;
+    long size;
+    for(size = n; size > 1; size >>= 1) {
+        depth_limit += 2;
+    }
+    while(hi > lo) {
+        if(depth_limit-- == 0) {
+            qsort_r(a + lo, hi - lo + 1, sizeof(long), integer_difference_sign, NULL);
+            return;
+        }
+        long mid = lo + (hi - lo)/2;
+        long x = a[lo], y = a[mid], z = a[hi];
+        long pivot = x < y ? (y < z ? y : (x < z ? z : x)) : (x < z ? x : (y < z ? z : y));
+        long i = lo;
+        long j = hi;
+        while(i <= j) {
+            while(a[i] < pivot) {
+                ++i;
+            }
+            while(a[j] > pivot) {
+                --j;
+            }
+            if(i <= j) {
+                long tmp = a[i];
+                a[i] = a[j];
+                a[j] = tmp;
+                ++i;
+                --j;
+            }
+        }
+        if(target <= j) {
+            hi = j;
+        } else if(target >= i) {
+            lo = i;
+        } else {
+            return;
+        }
+    }
+}
+
+void bounded_heap_init(struct bounded_heap *h, long capacity, bool keep_smallest) {
+    h->v = malloc(sizeof(long)*(capacity > 0 ? capacity : 1));
+    if(!h->v) {
+        fprintf(stderr, "Error allocating memory.\n");
+        exit(1);
+    }
+    h->size = 0;
+    h->capacity = capacity;
+    h->keep_smallest = keep_smallest;
+    h->sum = 0;
+}
+
+void bounded_heap_free(struct bounded_heap *h) {
+    free(h->v);
+    h->v = NULL;
+    h->size = 0;
+}
+
+// Whether a belongs nearer the root than b, ie would be evicted before it.
+bool bounded_heap_above(const struct bounded_heap *h, long a, long b) {
+    return h->keep_smallest ? a > b : a < b;
+}
+
+void bounded_heap_push(struct bounded_heap *h, long value) {
+    if(h->capacity <= 0) {
+        return;
+    }
+    long i;
+    if(h->size < h->capacity) {
+        i = h->size++;
+        while(i > 0 && bounded_heap_above(h, value, h->v[(i - 1)/2])) {
+            h->v[i] = h->v[(i - 1)/2];
+            i = (i - 1)/2;
+        }
+        h->v[i] = value;
+        h->sum += value;
+        return;
+    }
+    if(!bounded_heap_above(h, h->v[0], value)) {
+        return; // value would be the first to go, so it doesn't make the cut.
+    }
+    h->sum += value - h->v[0];
+    i = 0;
+    while(1) {
+        long child = 2*i + 1;
+        if(child >= h->size) {
+            break;
+        }
+        if(child + 1 < h->size && bounded_heap_above(h, h->v[child + 1], h->v[child])) {
+            ++child;
+        }
+        if(!bounded_heap_above(h, h->v[child], value)) {
+            break;
+        }
+        h->v[i] = h->v[child];
+        i = child;
+    }
+    h->v[i] = value;
+}
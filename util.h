@@ -1,3 +1,21 @@
 #pragma once
+#include <stdbool.h>
+
+/*
+   Retains the capacity smallest (or largest) values pushed into it, and
+   their sum. The root of the heap is the retained value that would be
+   evicted next.
+*/
+struct bounded_heap {
+    long *v;
+    long size;
+    long capacity;
+    bool keep_smallest;
+    long sum;
+};
 
 int integer_difference_sign(const void *a, const void *b, void *data);
+void select_smallest(long *a, long n, long k);
+void bounded_heap_init(struct bounded_heap *h, long capacity, bool keep_smallest);
+void bounded_heap_free(struct bounded_heap *h);
+void bounded_heap_push(struct bounded_heap *h, long value);